@@ -18,10 +18,16 @@ class WGacView;
 namespace elements {
 namespace wgac {
 
+class WGacShapedTextCache;
+
 class IWGacRenderTarget : public Object, public IGuiGraphicsRenderTarget
 {
 public:
     virtual cairo_t* GetCairoContext() = 0;
+    // Device pixels per logical pixel of the window being rendered
+    virtual double GetScaleFactor() = 0;
+    // Asks the window to paint again, for pixels that became available outside of the element tree
+    virtual void RequestRedraw() = 0;
 };
 
 class IWGacObjectProvider : public Interface
@@ -37,6 +43,13 @@ class IWGacResourceManager : public Interface
 {
 public:
     virtual PangoFontDescription* CreateWGacFont(const FontProperties& fontProperties) = 0;
+    // Shaped label text shared by every label renderer
+    virtual WGacShapedTextCache* GetShapedTextCache() = 0;
+    // One measurement context per render scale, shared by every layout created for that scale
+    virtual PangoContext* GetMeasurementContext(double scale) = 0;
+    // Borrows a recycled layout on the measurement context, return it with ReleaseLayout
+    virtual PangoLayout* AcquireLayout(double scale) = 0;
+    virtual void ReleaseLayout(PangoLayout* layout) = 0;
 };
 
 extern void SetCurrentRenderTarget(IWGacRenderTarget* renderTarget);
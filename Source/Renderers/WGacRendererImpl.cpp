@@ -4,6 +4,7 @@
 #include "../WGacGacView.h"
 #include "../Wayland/WaylandDisplay.h"
 #include "../Services/WGacImageService.h"
+#include "../Services/WGacTextIndex.h"
 #include <functional>
 
 using namespace vl::collections;
@@ -16,6 +17,35 @@ namespace wgac {
 // Forward declaration
 class WGacLayoutProvider;
 
+// Font family names used by paragraph styles, interned so a style run stores an index instead of a string.
+// Only used from the UI thread.
+class WGacFontFamilies
+{
+protected:
+    struct Table
+    {
+        Dictionary<WString, vint> indices;
+        List<WString> names;
+    };
+
+    static Table& GetTable()
+    {
+        static Table table;
+        return table;
+    }
+
+public:
+    static vint Intern(const WString& family)
+    {
+        auto& table = GetTable();
+        vint index = table.indices.Keys().IndexOf(family);
+        if (index >= 0) return table.indices.Values()[index];
+        vint id = table.names.Add(family);
+        table.indices.Add(family, id);
+        return id;
+    }
+};
+
 // WGacParagraph - Pango-based paragraph implementation with proper Unicode handling
 class WGacParagraph : public Object, public IGuiGraphicsParagraph
 {
@@ -24,10 +54,28 @@ protected:
     IGuiGraphicsRenderTarget* renderTarget;
     IGuiGraphicsParagraphCallback* paragraphCallback;
     WString text;
-    AString utf8Text;  // Cached UTF-8 version
+    wayland::WGacTextIndex textIndex;  // UTF-8 copy of the text for Pango, and positions between the two
+    // Borrowed from the resource manager's pool for the render scale of the target
     PangoLayout* layout;
-    cairo_surface_t* layoutSurface;
-    cairo_t* layoutCr;
+    double layoutScale;
+    // Only attributes that change shaping, colours and decorations are painted from the style runs
+    PangoAttrList* attributes;
+    // Text and layout properties, and attributes, not yet applied to the layout
+    bool layoutDirty;
+    bool attributesDirty;
+
+    // Geometry of every line in Pango units from the layout's top left, rebuilt after each relayout
+    struct LineGeometry
+    {
+        PangoLayoutLine* line;  // Owned by the layout
+        vint startByte;
+        vint endByte;
+        int left;
+        int top;
+        int height;
+        int baseline;
+    };
+    List<LineGeometry> lines;
 
     bool wrapLine;
     vint maxWidth;
@@ -42,26 +90,33 @@ protected:
     bool caretVisible;
     bool caretFrontSide;
 
-    // Text formatting - fragment-based like Uniscribe
-    struct TextFragment
+    // Text formatting - a sorted array of style runs, each run lasts until the next one starts.
+    // Plain data so runs are cheap to copy, compare and move.
+    struct TextRunStyle
     {
-        vint start;          // Character position
-        vint length;         // Character length
-        WString fontFamily;
+        vint fontFamily;     // Interned family, see WGacFontFamilies
         vint fontSize;
         bool bold;
         bool italic;
         bool underline;
         bool strikeline;
+        bool hasBackgroundColor;
         Color textColor;
         Color backgroundColor;
-        bool hasBackgroundColor;
 
-        TextFragment()
-            : start(0), length(0), fontSize(12)
-            , bold(false), italic(false), underline(false), strikeline(false)
-            , textColor(0, 0, 0), backgroundColor(255, 255, 255), hasBackgroundColor(false)
-        {}
+        bool operator==(const TextRunStyle& style) const
+        {
+            return fontFamily == style.fontFamily && fontSize == style.fontSize
+                && bold == style.bold && italic == style.italic && underline == style.underline && strikeline == style.strikeline
+                && hasBackgroundColor == style.hasBackgroundColor
+                && textColor == style.textColor && backgroundColor == style.backgroundColor;
+        }
+    };
+
+    struct TextRun
+    {
+        vint start;
+        TextRunStyle style;
     };
 
     // Inline object tracking
@@ -77,332 +132,445 @@ protected:
         {}
     };
 
-    List<TextFragment> fragments;
+    List<TextRun> runs;
     List<InlineObject> inlineObjects;
     FontProperties defaultFont;
 
-    // Byte position cache for fast conversion
-    Array<vint> charToByteMap;  // char index -> byte offset
-    Array<vint> byteToCharMap;  // byte offset -> char index (sparse, only valid at char boundaries)
-
-    void BuildPositionMaps()
+    vint CharToBytePos(vint charPos) const
     {
-        charToByteMap.Resize(text.Length() + 1);
-        utf8Text = wtoa(text);
+        return textIndex.CharToByte(charPos);
+    }
 
-        vint byteOffset = 0;
-        for (vint i = 0; i < text.Length(); i++)
-        {
-            charToByteMap[i] = byteOffset;
-            // Calculate UTF-8 byte length for this character
-            wchar_t ch = text[i];
-            if (ch < 0x80) byteOffset += 1;
-            else if (ch < 0x800) byteOffset += 2;
-            else if (ch >= 0xD800 && ch <= 0xDBFF)
-            {
-                // Surrogate pair - handle as 4 bytes
-                byteOffset += 4;
-                if (i + 1 < text.Length()) i++; // Skip low surrogate
-                charToByteMap[i] = byteOffset;
-            }
-            else byteOffset += 3;
-        }
-        charToByteMap[text.Length()] = byteOffset;
+    vint ByteToCharPos(vint bytePos) const
+    {
+        return textIndex.ByteToChar(bytePos);
+    }
 
-        // Build reverse map
-        byteToCharMap.Resize(utf8Text.Length() + 1);
-        for (vint i = 0; i <= text.Length(); i++)
-        {
-            if (charToByteMap[i] <= utf8Text.Length())
-            {
-                byteToCharMap[charToByteMap[i]] = i;
-            }
-        }
+    // Attributes are kept in one list that style changes update in place, the layout only picks
+    // them up when it is next queried, so a burst of style calls costs a single shaping pass
+    void ChangeAttribute(PangoAttribute* attr, vint start, vint length)
+    {
+        attr->start_index = (guint)CharToBytePos(start);
+        attr->end_index = (guint)CharToBytePos(start + length);
+        pango_attr_list_change(attributes, attr);
+        attributesDirty = true;
     }
 
-    vint CharToBytePos(vint charPos) const
+    void ChangeFontAttributes(const WString& family, vint size, vint start, vint length)
     {
-        if (charPos <= 0) return 0;
-        if (charPos >= text.Length()) return utf8Text.Length();
-        return charToByteMap[charPos];
+        AString fontFamily = wtoa(family.Length() > 0 ? family : defaultFont.fontFamily);
+        ChangeAttribute(pango_attr_family_new(fontFamily.Buffer()), start, length);
+        // Use absolute size to match font description
+        ChangeAttribute(pango_attr_size_new_absolute((size > 0 ? size : defaultFont.size) * PANGO_SCALE), start, length);
     }
 
-    vint ByteToCharPos(vint bytePos) const
+    static gboolean IsInlineObjectAttribute(PangoAttribute* attr, gpointer data)
     {
-        if (bytePos <= 0) return 0;
-        if (bytePos >= utf8Text.Length()) return text.Length();
+        auto range = static_cast<guint*>(data);
+        return attr->klass->type == PANGO_ATTR_SHAPE && attr->start_index >= range[0] && attr->end_index <= range[1];
+    }
 
-        // Find the character containing this byte
-        for (vint i = 0; i < text.Length(); i++)
+    void RemoveInlineObjectAttributes(const InlineObject& obj)
+    {
+        guint range[] = { (guint)CharToBytePos(obj.start), (guint)CharToBytePos(obj.start + obj.length) };
+        if (PangoAttrList* removed = pango_attr_list_filter(attributes, &WGacParagraph::IsInlineObjectAttribute, range))
         {
-            if (charToByteMap[i] <= bytePos && bytePos < charToByteMap[i + 1])
-            {
-                return i;
-            }
+            pango_attr_list_unref(removed);
         }
-        return text.Length();
+        attributesDirty = true;
     }
 
-    void RebuildLayout()
+    // GacUI uses placeholder text like "[Image]" (7 chars) or "[EmbeddedObject]" (16 chars)
+    // for inline objects. The shape attribute applies to each character individually,
+    // so we need to distribute the width across all characters in the range.
+    void InsertInlineObjectAttributes(const InlineObject& obj)
     {
-        if (!layout) return;
+        if (obj.length <= 0) return;
 
-        pango_layout_set_text(layout, utf8Text.Buffer(), utf8Text.Length());
+        guint startByte = CharToBytePos(obj.start);
+        guint endByte = CharToBytePos(obj.start + obj.length);
 
-        if (wrapLine && maxWidth > 0)
-        {
-            // Wrap mode: set width for both wrapping and alignment
-            pango_layout_set_width(layout, maxWidth * PANGO_SCALE);
-            pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+        // Calculate how many UTF-8 bytes are in this range
+        vint byteLength = endByte - startByte;
+        if (byteLength <= 0) return;
 
-            PangoAlignment pangoAlign = PANGO_ALIGN_LEFT;
-            switch (paragraphAlignment)
-            {
-                case Alignment::Left: pangoAlign = PANGO_ALIGN_LEFT; break;
-                case Alignment::Center: pangoAlign = PANGO_ALIGN_CENTER; break;
-                case Alignment::Right: pangoAlign = PANGO_ALIGN_RIGHT; break;
-            }
-            pango_layout_set_alignment(layout, pangoAlign);
+        // Use the size from properties (convert to Pango units)
+        int totalWidth = (int)(obj.properties.size.x * PANGO_SCALE);
+        int height = (int)(obj.properties.size.y * PANGO_SCALE);
+
+        // Baseline: distance from top of object to the text baseline
+        // If baseline is -1, the baseline is at the bottom of the object
+        int baseline;
+        if (obj.properties.baseline < 0)
+        {
+            baseline = height;  // Baseline at bottom
         }
         else
         {
-            // No wrap: use infinite width, alignment handled in Render()
-            pango_layout_set_width(layout, -1);
-            pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
+            baseline = height - (int)(obj.properties.baseline * PANGO_SCALE);
         }
 
-        // Build attributes from fragments
-        PangoAttrList* attrList = pango_attr_list_new();
-
-        for (vint i = 0; i < fragments.Count(); i++)
+        // Apply shape attribute to each byte in the range
+        // The first byte gets the full shape dimensions,
+        // subsequent bytes get zero width to avoid accumulating space
+        for (vint b = startByte; b < (vint)endByte; b++)
         {
-            TextFragment& frag = fragments[i];
-            if (frag.length <= 0) continue;
-
-            guint startByte = CharToBytePos(frag.start);
-            guint endByte = CharToBytePos(frag.start + frag.length);
-
-            AString fontFamily = wtoa(frag.fontFamily.Length() > 0 ? frag.fontFamily : defaultFont.fontFamily);
+            PangoRectangle inkRect;
+            inkRect.x = 0;
+            inkRect.y = -baseline;
+            inkRect.width = b == (vint)startByte ? totalWidth : 0;
+            inkRect.height = height;
+            PangoRectangle logicalRect = inkRect;
+
+            PangoAttribute* attr = pango_attr_shape_new(&inkRect, &logicalRect);
+            attr->start_index = b;
+            attr->end_index = b + 1;
+            pango_attr_list_insert(attributes, attr);
+        }
 
-            PangoAttribute* attr;
+        // Shaped placeholders get empty glyphs, so the placeholder text is never painted
+        attributesDirty = true;
+    }
 
-            // Font family
-            attr = pango_attr_family_new(fontFamily.Buffer());
-            attr->start_index = startByte;
-            attr->end_index = endByte;
-            pango_attr_list_insert(attrList, attr);
+    // Applies pending changes, called before anything reads the layout
+    void EnsureLayout()
+    {
+        if (!layout) return;
+        if (!layoutDirty && !attributesDirty) return;
 
-            // Font size (use absolute size to match font description)
-            attr = pango_attr_size_new_absolute((frag.fontSize > 0 ? frag.fontSize : defaultFont.size) * PANGO_SCALE);
-            attr->start_index = startByte;
-            attr->end_index = endByte;
-            pango_attr_list_insert(attrList, attr);
+        if (layoutDirty)
+        {
+            layoutDirty = false;
+            pango_layout_set_text(layout, textIndex.GetUtf8().Buffer(), textIndex.GetUtf8().Length());
 
-            // Bold
-            if (frag.bold)
+            if (wrapLine && maxWidth > 0)
             {
-                attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
-                attr->start_index = startByte;
-                attr->end_index = endByte;
-                pango_attr_list_insert(attrList, attr);
-            }
+                // Wrap mode: set width for both wrapping and alignment
+                pango_layout_set_width(layout, maxWidth * PANGO_SCALE);
+                pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
 
-            // Italic
-            if (frag.italic)
-            {
-                attr = pango_attr_style_new(PANGO_STYLE_ITALIC);
-                attr->start_index = startByte;
-                attr->end_index = endByte;
-                pango_attr_list_insert(attrList, attr);
+                PangoAlignment pangoAlign = PANGO_ALIGN_LEFT;
+                switch (paragraphAlignment)
+                {
+                    case Alignment::Left: pangoAlign = PANGO_ALIGN_LEFT; break;
+                    case Alignment::Center: pangoAlign = PANGO_ALIGN_CENTER; break;
+                    case Alignment::Right: pangoAlign = PANGO_ALIGN_RIGHT; break;
+                }
+                pango_layout_set_alignment(layout, pangoAlign);
             }
-
-            // Underline
-            if (frag.underline)
+            else
             {
-                attr = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-                attr->start_index = startByte;
-                attr->end_index = endByte;
-                pango_attr_list_insert(attrList, attr);
+                // No wrap: use infinite width, alignment handled in Render()
+                pango_layout_set_width(layout, -1);
+                pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
             }
+        }
 
-            // Strikethrough
-            if (frag.strikeline)
-            {
-                attr = pango_attr_strikethrough_new(TRUE);
-                attr->start_index = startByte;
-                attr->end_index = endByte;
-                pango_attr_list_insert(attrList, attr);
-            }
+        if (attributesDirty)
+        {
+            attributesDirty = false;
+            // The layout ignores a list it already holds, even when its content changed
+            pango_layout_set_attributes(layout, nullptr);
+            pango_layout_set_attributes(layout, attributes);
+        }
 
-            // Text color
-            attr = pango_attr_foreground_new(frag.textColor.r * 257, frag.textColor.g * 257, frag.textColor.b * 257);
-            attr->start_index = startByte;
-            attr->end_index = endByte;
-            pango_attr_list_insert(attrList, attr);
+        lines.Clear();
+        PangoLayoutIter* iter = pango_layout_get_iter(layout);
+        do
+        {
+            LineGeometry geometry;
+            geometry.line = pango_layout_iter_get_line_readonly(iter);
+            geometry.startByte = geometry.line->start_index;
+            geometry.endByte = geometry.line->start_index + geometry.line->length;
+            PangoRectangle logical;
+            pango_layout_iter_get_line_extents(iter, nullptr, &logical);
+            int y0, y1;
+            pango_layout_iter_get_line_yrange(iter, &y0, &y1);
+            geometry.left = logical.x;
+            geometry.top = y0;
+            geometry.height = y1 - y0;
+            geometry.baseline = pango_layout_iter_get_baseline(iter);
+            lines.Add(geometry);
+        } while (pango_layout_iter_next_line(iter));
+        pango_layout_iter_free(iter);
+    }
+
+    // Index of the line containing the byte, the last line for the end of the text
+    vint FindLineAtByte(vint byte)
+    {
+        vint low = 0;
+        vint high = lines.Count() - 1;
+        while (low < high)
+        {
+            vint middle = (low + high + 1) / 2;
+            if (lines[middle].startByte <= byte) low = middle;
+            else high = middle - 1;
+        }
+        return low;
+    }
+
+    // Style run covering the byte, which must start a character, and its byte range
+    vint FindRunAtByte(vint byte, vint& startByte, vint& endByte)
+    {
+        vint index = FindRun(ByteToCharPos(byte));
+        startByte = CharToBytePos(runs[index].start);
+        endByte = index + 1 < runs.Count() ? CharToBytePos(runs[index + 1].start) : textIndex.GetUtf8().Length();
+        return index;
+    }
+
+    // Index of the first inline object ending after the position
+    vint FindInlineObject(vint position)
+    {
+        vint low = 0;
+        vint high = inlineObjects.Count();
+        while (low < high)
+        {
+            vint middle = (low + high) / 2;
+            if (inlineObjects[middle].start + inlineObjects[middle].length > position) high = middle;
+            else low = middle + 1;
+        }
+        return low;
+    }
+
+    // Index of the first line reaching below y, in Pango units from the layout's top
+    vint FindLineAtY(int y)
+    {
+        vint low = 0;
+        vint high = lines.Count() - 1;
+        while (low < high)
+        {
+            vint middle = (low + high) / 2;
+            if (lines[middle].top + lines[middle].height > y) high = middle;
+            else low = middle + 1;
+        }
+        return low;
+    }
+
+    void PaintBackgrounds(cairo_t* cr, vint firstLine, vint lastLine, double originX, double originY)
+    {
+        for (vint l = firstLine; l <= lastLine; l++)
+        {
+            auto& line = lines[l];
+            if (line.startByte >= line.endByte) continue;
 
-            // Background color
-            if (frag.hasBackgroundColor)
+            // Every style run overlapping the line
+            vint startByte, endByte;
+            vint i = FindRunAtByte(line.startByte, startByte, endByte);
+            while (startByte < line.endByte)
             {
-                attr = pango_attr_background_new(frag.backgroundColor.r * 257,
-                                                  frag.backgroundColor.g * 257,
-                                                  frag.backgroundColor.b * 257);
-                attr->start_index = startByte;
-                attr->end_index = endByte;
-                pango_attr_list_insert(attrList, attr);
+                auto& style = runs[i].style;
+                if (style.hasBackgroundColor)
+                {
+                    PaintBackground(cr, line, startByte, endByte, style.backgroundColor, originX, originY);
+                }
+                if (++i == runs.Count()) break;
+                startByte = endByte;
+                endByte = i + 1 < runs.Count() ? CharToBytePos(runs[i + 1].start) : textIndex.GetUtf8().Length();
             }
         }
+    }
 
-        // Add shape attributes for inline objects
-        // GacUI uses placeholder text like "[Image]" (7 chars) or "[EmbeddedObject]" (16 chars)
-        // for inline objects. The shape attribute applies to each character individually,
-        // so we need to distribute the width across all characters in the range.
-        for (vint i = 0; i < inlineObjects.Count(); i++)
+    void PaintBackground(cairo_t* cr, const LineGeometry& line, vint startByte, vint endByte, Color color, double originX, double originY)
+    {
+        int* ranges = nullptr;
+        int rangeCount = 0;
+        pango_layout_line_get_x_ranges(line.line, (int)(startByte > line.startByte ? startByte : line.startByte),
+            (int)(endByte < line.endByte ? endByte : line.endByte), &ranges, &rangeCount);
+        for (int r = 0; r < rangeCount; r++)
         {
-            InlineObject& obj = inlineObjects[i];
-            if (obj.length <= 0) continue;
-
-            guint startByte = CharToBytePos(obj.start);
-            guint endByte = CharToBytePos(obj.start + obj.length);
+            cairo_rectangle(cr,
+                originX + (double)ranges[r * 2] / PANGO_SCALE, originY + (double)line.top / PANGO_SCALE,
+                (double)(ranges[r * 2 + 1] - ranges[r * 2]) / PANGO_SCALE, (double)line.height / PANGO_SCALE);
+        }
+        g_free(ranges);
+        cairo_set_source_rgba(cr, color.r / 255.0, color.g / 255.0, color.b / 255.0, color.a / 255.0);
+        cairo_fill(cr);
+    }
 
-            // Calculate how many UTF-8 bytes are in this range
-            vint byteLength = endByte - startByte;
-            if (byteLength <= 0) continue;
+    void PaintGlyphs(cairo_t* cr, PangoFont* font, PangoGlyphString* glyphs, vint first, vint last, double x, double baseline, const TextRunStyle& style)
+    {
+        // A view of part of the glyph string, nothing is copied
+        PangoGlyphString segment = *glyphs;
+        segment.num_glyphs = (gint)(last - first);
+        segment.glyphs = glyphs->glyphs + first;
+        segment.log_clusters = glyphs->log_clusters + first;
 
-            // Use the size from properties (convert to Pango units)
-            int totalWidth = (int)(obj.properties.size.x * PANGO_SCALE);
-            int height = (int)(obj.properties.size.y * PANGO_SCALE);
+        cairo_set_source_rgba(cr, style.textColor.r / 255.0, style.textColor.g / 255.0,
+                              style.textColor.b / 255.0, style.textColor.a / 255.0);
+        cairo_move_to(cr, x, baseline);
+        pango_cairo_show_glyph_string(cr, font, &segment);
 
-            // Baseline: distance from top of object to the text baseline
-            // If baseline is -1, the baseline is at the bottom of the object
-            int baseline;
-            if (obj.properties.baseline < 0)
+        if (style.underline || style.strikeline)
+        {
+            double width = (double)pango_glyph_string_get_width(&segment) / PANGO_SCALE;
+            PangoFontMetrics* metrics = pango_font_get_metrics(font, nullptr);
+            if (style.underline)
             {
-                baseline = height;  // Baseline at bottom
+                cairo_rectangle(cr, x, baseline - (double)pango_font_metrics_get_underline_position(metrics) / PANGO_SCALE,
+                    width, (double)pango_font_metrics_get_underline_thickness(metrics) / PANGO_SCALE);
             }
-            else
+            if (style.strikeline)
             {
-                baseline = height - (int)(obj.properties.baseline * PANGO_SCALE);
+                cairo_rectangle(cr, x, baseline - (double)pango_font_metrics_get_strikethrough_position(metrics) / PANGO_SCALE,
+                    width, (double)pango_font_metrics_get_strikethrough_thickness(metrics) / PANGO_SCALE);
             }
+            pango_font_metrics_unref(metrics);
+            cairo_fill(cr);
+        }
+    }
 
-            // Apply shape attribute to each byte in the range
-            // The first byte gets the full shape dimensions,
-            // subsequent bytes get zero width to avoid accumulating space
-            for (vint b = startByte; b < (vint)endByte; b++)
+    // Splits the glyph item where the style runs change colour or decoration
+    void PaintGlyphItem(cairo_t* cr, PangoGlyphItem* item, double x, double baseline)
+    {
+        PangoGlyphString* glyphs = item->glyphs;
+        vint style = -1;
+        vint styleStart = 0;
+        vint styleEnd = 0;
+        vint first = 0;
+        int firstX = 0;
+        int glyphX = 0;
+        for (vint i = 0; i < glyphs->num_glyphs; i++)
+        {
+            vint byte = item->item->offset + glyphs->log_clusters[i];
+            if (style == -1 || byte < styleStart || byte >= styleEnd)
             {
-                PangoRectangle inkRect;
-                PangoRectangle logicalRect;
-
-                if (b == (vint)startByte)
-                {
-                    // First byte: full width and height
-                    inkRect.x = 0;
-                    inkRect.y = -baseline;
-                    inkRect.width = totalWidth;
-                    inkRect.height = height;
-                }
-                else
+                vint next = FindRunAtByte(byte, styleStart, styleEnd);
+                if (style != -1)
                 {
-                    // Subsequent bytes: zero width, same height (for line height calculation)
-                    inkRect.x = 0;
-                    inkRect.y = -baseline;
-                    inkRect.width = 0;
-                    inkRect.height = height;
+                    PaintGlyphs(cr, item->item->analysis.font, glyphs, first, i, x + (double)firstX / PANGO_SCALE, baseline, runs[style].style);
                 }
-                logicalRect = inkRect;
-
-                PangoAttribute* attr = pango_attr_shape_new(&inkRect, &logicalRect);
-                attr->start_index = b;
-                attr->end_index = b + 1;
-                pango_attr_list_insert(attrList, attr);
+                style = next;
+                first = i;
+                firstX = glyphX;
             }
+            glyphX += glyphs->glyphs[i].geometry.width;
+        }
+        if (style != -1)
+        {
+            PaintGlyphs(cr, item->item->analysis.font, glyphs, first, glyphs->num_glyphs, x + (double)firstX / PANGO_SCALE, baseline, runs[style].style);
+        }
+    }
 
-            // Make the placeholder text invisible (fully transparent)
-            // so it doesn't render on top of the inline object
-            PangoAttribute* fgAttr = pango_attr_foreground_alpha_new(0);
-            fgAttr->start_index = startByte;
-            fgAttr->end_index = endByte;
-            pango_attr_list_insert(attrList, fgAttr);
+    void PaintLine(cairo_t* cr, const LineGeometry& line, double originX, double originY)
+    {
+        int x = line.left;
+        double baseline = originY + (double)line.baseline / PANGO_SCALE;
+        for (GSList* node = line.line->runs; node; node = node->next)
+        {
+            auto item = static_cast<PangoGlyphItem*>(node->data);
+            PaintGlyphItem(cr, item, originX + (double)x / PANGO_SCALE, baseline);
+            x += pango_glyph_string_get_width(item->glyphs);
         }
+    }
+
+    void AcquireLayout()
+    {
+        layout = GetWGacResourceManager()->AcquireLayout(layoutScale);
+        layoutDirty = true;
+        attributesDirty = true;
 
-        pango_layout_set_attributes(layout, attrList);
-        pango_attr_list_unref(attrList);
+        // Set default font
+        PangoFontDescription* fontDesc = pango_font_description_new();
+        AString family = wtoa(defaultFont.fontFamily);
+        pango_font_description_set_family(fontDesc, family.Buffer());
+        pango_font_description_set_absolute_size(fontDesc, defaultFont.size * PANGO_SCALE);
+        pango_layout_set_font_description(layout, fontDesc);
+        pango_font_description_free(fontDesc);
     }
 
-    // Fragment manipulation helpers (like Uniscribe's CutFragment)
-    void SplitFragmentAt(vint position)
+    // Index of the run containing the position, runs must not be empty
+    vint FindRun(vint position)
     {
-        for (vint i = 0; i < fragments.Count(); i++)
+        vint low = 0;
+        vint high = runs.Count() - 1;
+        while (low < high)
         {
-            TextFragment& frag = fragments[i];
-            if (frag.start < position && position < frag.start + frag.length)
-            {
-                // Need to split this fragment
-                TextFragment newFrag = frag;
-                newFrag.start = position;
-                newFrag.length = frag.start + frag.length - position;
-                frag.length = position - frag.start;
-                fragments.Insert(i + 1, newFrag);
-                return;
-            }
+            vint middle = (low + high + 1) / 2;
+            if (runs[middle].start <= position) low = middle;
+            else high = middle - 1;
         }
+        return low;
     }
 
-    void ApplyStyleToRange(vint start, vint length, std::function<void(TextFragment&)> modifier)
+    // Makes a run start at the position and returns its index, the end of the text has no run
+    vint SplitRunAt(vint position)
     {
-        if (length <= 0) return;
-        vint end = start + length;
-
-        // First, split fragments at boundaries if needed
-        SplitFragmentAt(start);
-        SplitFragmentAt(end);
+        if (position >= text.Length()) return runs.Count();
+        vint index = FindRun(position);
+        if (runs[index].start == position) return index;
+        TextRun run = runs[index];
+        run.start = position;
+        runs.Insert(index + 1, run);
+        return index + 1;
+    }
 
-        // Then apply the modifier to all fragments in range
-        for (vint i = 0; i < fragments.Count(); i++)
+    // Removes runs in [first, last] that have the same style as the run before them
+    void MergeRuns(vint first, vint last)
+    {
+        if (first < 1) first = 1;
+        if (last > runs.Count() - 1) last = runs.Count() - 1;
+        vint target = first;
+        for (vint i = first; i <= last; i++)
         {
-            TextFragment& frag = fragments[i];
-            if (frag.start >= start && frag.start + frag.length <= end)
+            if (!(runs[i].style == runs[target - 1].style))
             {
-                modifier(frag);
+                if (target != i) runs[target] = runs[i];
+                target++;
             }
         }
+        if (target <= last)
+        {
+            runs.RemoveRange(target, last - target + 1);
+        }
+    }
+
+    // O(log n + k) for k runs in the range, plus moving the array tail when runs are split or merged
+    template<typename TModifier>
+    void ApplyStyleToRange(vint start, vint length, TModifier&& modifier)
+    {
+        if (length <= 0 || runs.Count() == 0) return;
+        vint first = SplitRunAt(start);
+        vint last = SplitRunAt(start + length);
+        for (vint i = first; i < last; i++)
+        {
+            modifier(runs[i].style);
+        }
+        MergeRuns(first, last);
     }
 
     // Get line info for a character position
-    bool GetLineFromCharPos(vint charPos, int& lineIndex, int& lineStartChar, int& lineEndChar)
+    bool GetLineFromCharPos(vint charPos, vint& lineIndex, vint& lineStartChar, vint& lineEndChar)
     {
         if (!layout) return false;
 
-        vint bytePos = CharToBytePos(charPos);
-        int xPos;
-        pango_layout_index_to_line_x(layout, bytePos, FALSE, &lineIndex, &xPos);
+        lineIndex = FindLineAtByte(CharToBytePos(charPos));
+        lineStartChar = ByteToCharPos(lines[lineIndex].startByte);
+        lineEndChar = ByteToCharPos(lines[lineIndex].endByte);
+        return true;
+    }
 
-        PangoLayoutIter* iter = pango_layout_get_iter(layout);
-        int currentLine = 0;
-        do
-        {
-            if (currentLine == lineIndex)
-            {
-                PangoLayoutLine* line = pango_layout_iter_get_line_readonly(iter);
-                lineStartChar = ByteToCharPos(line->start_index);
-                lineEndChar = ByteToCharPos(line->start_index + line->length);
-                pango_layout_iter_free(iter);
-                return true;
-            }
-            currentLine++;
-        } while (pango_layout_iter_next_line(iter));
+    // Caret rectangle in Pango units from the layout's top left, with no width
+    PangoRectangle GetCaretRect(vint caret)
+    {
+        vint bytePos = CharToBytePos(caret);
+        auto& line = lines[FindLineAtByte(bytePos)];
+        int x;
+        pango_layout_line_index_to_x(line.line, (int)bytePos, FALSE, &x);
 
-        pango_layout_iter_free(iter);
-        return false;
+        PangoRectangle rect;
+        rect.x = line.left + x;
+        rect.y = line.top;
+        rect.width = 0;
+        rect.height = line.height;
+        return rect;
     }
 
-    // Get caret position from X coordinate on a specific line
-    vint GetCaretFromXWithLine(int x, int lineIndex)
+    // Get caret position from X coordinate on a specific line, in Pango units from the layout's left
+    vint GetCaretFromXWithLine(int x, vint lineIndex)
     {
-        PangoLayoutLine* line = pango_layout_get_line_readonly(layout, lineIndex);
-        if (!line) return -1;
-
+        auto& line = lines[lineIndex];
         int index, trailing;
-        pango_layout_line_x_to_index(line, x, &index, &trailing);
+        pango_layout_line_x_to_index(line.line, x - line.left, &index, &trailing);
 
         vint charPos = ByteToCharPos(index);
         if (trailing > 0) charPos++;
@@ -418,8 +586,10 @@ public:
         , paragraphCallback(_callback)
         , text(_text)
         , layout(nullptr)
-        , layoutSurface(nullptr)
-        , layoutCr(nullptr)
+        , layoutScale(1.0)
+        , attributes(pango_attr_list_new())
+        , layoutDirty(true)
+        , attributesDirty(true)
         , wrapLine(false)
         , maxWidth(-1)
         , paragraphAlignment(Alignment::Left)
@@ -431,42 +601,38 @@ public:
     {
         defaultFont = GetCurrentController()->ResourceService()->GetDefaultFont();
 
-        // Build position maps for UTF-8 conversion
-        BuildPositionMaps();
-
-        // Create a dummy surface for layout calculations
-        layoutSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-        layoutCr = cairo_create(layoutSurface);
-        layout = pango_cairo_create_layout(layoutCr);
+        textIndex.SetText(text);
 
-        // Set default font
-        PangoFontDescription* fontDesc = pango_font_description_new();
-        AString family = wtoa(defaultFont.fontFamily);
-        pango_font_description_set_family(fontDesc, family.Buffer());
-        pango_font_description_set_absolute_size(fontDesc, defaultFont.size * PANGO_SCALE);
-        pango_layout_set_font_description(layout, fontDesc);
-        pango_font_description_free(fontDesc);
+        if (auto target = dynamic_cast<IWGacRenderTarget*>(renderTarget))
+        {
+            layoutScale = target->GetScaleFactor();
+        }
+        AcquireLayout();
 
-        // Initialize with a single fragment covering all text
+        // Initialize with a single run covering all text
         if (text.Length() > 0)
         {
-            TextFragment frag;
-            frag.start = 0;
-            frag.length = text.Length();
-            frag.fontFamily = defaultFont.fontFamily;
-            frag.fontSize = defaultFont.size;
-            frag.textColor = Color(0, 0, 0);
-            fragments.Add(frag);
+            TextRun run;
+            run.start = 0;
+            run.style.fontFamily = WGacFontFamilies::Intern(defaultFont.fontFamily);
+            run.style.fontSize = defaultFont.size;
+            run.style.bold = false;
+            run.style.italic = false;
+            run.style.underline = false;
+            run.style.strikeline = false;
+            run.style.hasBackgroundColor = false;
+            run.style.textColor = Color(0, 0, 0);
+            run.style.backgroundColor = Color(255, 255, 255);
+            runs.Add(run);
+
+            ChangeFontAttributes(defaultFont.fontFamily, defaultFont.size, 0, text.Length());
         }
-
-        RebuildLayout();
     }
 
     ~WGacParagraph()
     {
-        if (layout) g_object_unref(layout);
-        if (layoutCr) cairo_destroy(layoutCr);
-        if (layoutSurface) cairo_surface_destroy(layoutSurface);
+        GetWGacResourceManager()->ReleaseLayout(layout);
+        pango_attr_list_unref(attributes);
     }
 
     IGuiGraphicsLayoutProvider* GetProvider() override;
@@ -480,7 +646,7 @@ public:
         if (wrapLine != value)
         {
             wrapLine = value;
-            RebuildLayout();
+            layoutDirty = true;
         }
     }
 
@@ -491,7 +657,7 @@ public:
         if (maxWidth != value)
         {
             maxWidth = value;
-            RebuildLayout();
+            layoutDirty = true;
         }
     }
 
@@ -502,7 +668,7 @@ public:
         if (paragraphAlignment != value)
         {
             paragraphAlignment = value;
-            RebuildLayout();
+            layoutDirty = true;
         }
     }
 
@@ -511,8 +677,10 @@ public:
         if (length == 0) return true;
         if (start < 0 || start + length > text.Length()) return false;
 
-        ApplyStyleToRange(start, length, [&](TextFragment& frag) { frag.fontFamily = value; });
-        RebuildLayout();
+        vint family = WGacFontFamilies::Intern(value);
+        ApplyStyleToRange(start, length, [=](TextRunStyle& style) { style.fontFamily = family; });
+        AString fontFamily = wtoa(value.Length() > 0 ? value : defaultFont.fontFamily);
+        ChangeAttribute(pango_attr_family_new(fontFamily.Buffer()), start, length);
         return true;
     }
 
@@ -521,8 +689,8 @@ public:
         if (length == 0) return true;
         if (start < 0 || start + length > text.Length()) return false;
 
-        ApplyStyleToRange(start, length, [&](TextFragment& frag) { frag.fontSize = value; });
-        RebuildLayout();
+        ApplyStyleToRange(start, length, [=](TextRunStyle& style) { style.fontSize = value; });
+        ChangeAttribute(pango_attr_size_new_absolute((value > 0 ? value : defaultFont.size) * PANGO_SCALE), start, length);
         return true;
     }
 
@@ -531,13 +699,15 @@ public:
         if (length == 0) return true;
         if (start < 0 || start + length > text.Length()) return false;
 
-        ApplyStyleToRange(start, length, [&](TextFragment& frag) {
-            frag.bold = (value & Bold) != 0;
-            frag.italic = (value & Italic) != 0;
-            frag.underline = (value & Underline) != 0;
-            frag.strikeline = (value & Strikeline) != 0;
+        ApplyStyleToRange(start, length, [=](TextRunStyle& style) {
+            style.bold = (value & Bold) != 0;
+            style.italic = (value & Italic) != 0;
+            style.underline = (value & Underline) != 0;
+            style.strikeline = (value & Strikeline) != 0;
         });
-        RebuildLayout();
+        // Underline and strikeline are painted, only weight and slant need shaping
+        ChangeAttribute(pango_attr_weight_new((value & Bold) ? PANGO_WEIGHT_BOLD : PANGO_WEIGHT_NORMAL), start, length);
+        ChangeAttribute(pango_attr_style_new((value & Italic) ? PANGO_STYLE_ITALIC : PANGO_STYLE_NORMAL), start, length);
         return true;
     }
 
@@ -546,8 +716,8 @@ public:
         if (length == 0) return true;
         if (start < 0 || start + length > text.Length()) return false;
 
-        ApplyStyleToRange(start, length, [&](TextFragment& frag) { frag.textColor = value; });
-        RebuildLayout();
+        // Painted from the style runs, the layout is not touched
+        ApplyStyleToRange(start, length, [=](TextRunStyle& style) { style.textColor = value; });
         return true;
     }
 
@@ -556,11 +726,10 @@ public:
         if (length == 0) return true;
         if (start < 0 || start + length > text.Length()) return false;
 
-        ApplyStyleToRange(start, length, [&](TextFragment& frag) {
-            frag.backgroundColor = value;
-            frag.hasBackgroundColor = (value.a != 0);
+        ApplyStyleToRange(start, length, [=](TextRunStyle& style) {
+            style.backgroundColor = value;
+            style.hasBackgroundColor = (value.a != 0);
         });
-        RebuildLayout();
         return true;
     }
 
@@ -570,22 +739,19 @@ public:
         if (start < 0 || start + length > text.Length()) return false;
 
         // Check if this range overlaps with existing inline objects
-        for (vint i = 0; i < inlineObjects.Count(); i++)
+        vint next = FindInlineObject(start);
+        if (next < inlineObjects.Count() && inlineObjects[next].start < start + length)
         {
-            InlineObject& obj = inlineObjects[i];
-            if (start < obj.start + obj.length && obj.start < start + length)
-            {
-                // Overlapping range - fail
-                return false;
-            }
+            // Overlapping range - fail
+            return false;
         }
 
-        // Add new inline object
+        // Add new inline object, keeping them sorted by position
         InlineObject newObj;
         newObj.start = start;
         newObj.length = length;
         newObj.properties = properties;
-        inlineObjects.Add(newObj);
+        inlineObjects.Insert(next, newObj);
 
         // Set render target on background image if present
         if (properties.backgroundImage)
@@ -597,7 +763,7 @@ public:
             }
         }
 
-        RebuildLayout();
+        InsertInlineObjectAttributes(newObj);
         return true;
     }
 
@@ -617,8 +783,8 @@ public:
                         renderer->SetRenderTarget(nullptr);
                     }
                 }
+                RemoveInlineObjectAttributes(obj);
                 inlineObjects.RemoveAt(i);
-                RebuildLayout();
                 return true;
             }
         }
@@ -628,6 +794,7 @@ public:
     Size GetSize() override
     {
         if (!layout) return Size(0, 0);
+        EnsureLayout();
         int width, height;
         pango_layout_get_pixel_size(layout, &width, &height);
         // Add 2 pixels for the caret at the end of text
@@ -661,6 +828,15 @@ public:
         cairo_t* cr = target->GetCairoContext();
         if (!cr || !layout) return;
 
+        // The window moved to an output with a different scale, measure with the matching context
+        if (target->GetScaleFactor() != layoutScale)
+        {
+            GetWGacResourceManager()->ReleaseLayout(layout);
+            layoutScale = target->GetScaleFactor();
+            AcquireLayout();
+        }
+        EnsureLayout();
+
         cairo_save(cr);
 
         // Calculate alignment offset when not wrapping
@@ -693,19 +869,45 @@ public:
         lastAlignOffsetX = alignOffsetX;
         lastRenderWidth = alignWidth;
 
-        // Render the text
-        cairo_move_to(cr, bounds.x1 + alignOffsetX, bounds.y1);
-        pango_cairo_show_layout(cr, layout);
+        // Only lines intersecting the clipper are painted
+        Rect clipper = renderTarget->GetClipper();
+        int clipTop = (int)(clipper.y1 - bounds.y1) * PANGO_SCALE;
+        int clipBottom = (int)(clipper.y2 - bounds.y1) * PANGO_SCALE;
+        vint firstLine = FindLineAtY(clipTop);
+        vint lastLine = FindLineAtY(clipBottom);
+        while (lastLine >= firstLine && lines[lastLine].top >= clipBottom) lastLine--;
+        if (lastLine >= firstLine && lines[firstLine].top + lines[firstLine].height <= clipTop) lastLine = firstLine - 1;
+
+        // Backgrounds first, then glyphs coloured by their style runs
+        double originX = bounds.x1 + alignOffsetX;
+        double originY = bounds.y1;
+        if (runs.Count() > 0)
+        {
+            PaintBackgrounds(cr, firstLine, lastLine, originX, originY);
+            for (vint i = firstLine; i <= lastLine; i++)
+            {
+                PaintLine(cr, lines[i], originX, originY);
+            }
+        }
 
-        // Render inline objects
+        // Every inline object gets its bounds and callback, the callback places embedded controls
+        // even when they are scrolled out of the clipper, only painting is limited to the visible lines
         for (vint i = 0; i < inlineObjects.Count(); i++)
         {
             InlineObject& obj = inlineObjects[i];
 
-            // Get the position of this inline object from the layout
+            // Get the position of this inline object from its line
             vint bytePos = CharToBytePos(obj.start);
+            vint lineIndex = FindLineAtByte(bytePos);
+            auto& line = lines[lineIndex];
+            int leading, trailing;
+            pango_layout_line_index_to_x(line.line, (int)bytePos, FALSE, &leading);
+            pango_layout_line_index_to_x(line.line, (int)bytePos, TRUE, &trailing);
             PangoRectangle pos;
-            pango_layout_index_to_pos(layout, bytePos, &pos);
+            pos.x = line.left + (leading < trailing ? leading : trailing);
+            pos.y = line.top;
+            pos.width = leading < trailing ? trailing - leading : leading - trailing;
+            pos.height = line.height;
 
             // Convert to pixel coordinates and apply bounds offset with alignment
             int objX = bounds.x1 + alignOffsetX + pos.x / PANGO_SCALE;
@@ -718,7 +920,7 @@ public:
                                     Size(objWidth, objHeight));
 
             // Render background image if present
-            if (obj.properties.backgroundImage)
+            if (obj.properties.backgroundImage && lineIndex >= firstLine && lineIndex <= lastLine)
             {
                 IGuiGraphicsRenderer* graphicsRenderer = obj.properties.backgroundImage->GetRenderer();
                 if (graphicsRenderer)
@@ -736,7 +938,10 @@ public:
                 // Update the properties with new size if it changed
                 if (newSize.x != obj.properties.size.x || newSize.y != obj.properties.size.y)
                 {
+                    // Reshaped with the new size the next time the layout is used
+                    RemoveInlineObjectAttributes(obj);
                     obj.properties.size = newSize;
+                    InsertInlineObjectAttributes(obj);
                 }
             }
         }
@@ -744,9 +949,7 @@ public:
         // Render caret if visible
         if (caretVisible && caretPos >= 0)
         {
-            PangoRectangle strongPos, weakPos;
-            vint bytePos = CharToBytePos(caretPos);
-            pango_layout_get_cursor_pos(layout, bytePos, &strongPos, &weakPos);
+            PangoRectangle strongPos = GetCaretRect(caretPos);
 
             int cx = bounds.x1 + alignOffsetX + strongPos.x / PANGO_SCALE;
             int cy = bounds.y1 + strongPos.y / PANGO_SCALE;
@@ -766,6 +969,7 @@ public:
     vint GetCaret(vint comparingCaret, CaretRelativePosition position, bool& preferFrontSide) override
     {
         if (!layout) return -1;
+        EnsureLayout();
 
         vint textLen = text.Length();
 
@@ -785,7 +989,7 @@ public:
         {
             case CaretLineFirst:
             {
-                int lineIndex, lineStart, lineEnd;
+                vint lineIndex, lineStart, lineEnd;
                 if (GetLineFromCharPos(comparingCaret, lineIndex, lineStart, lineEnd))
                 {
                     preferFrontSide = false;
@@ -795,7 +999,7 @@ public:
             }
             case CaretLineLast:
             {
-                int lineIndex, lineStart, lineEnd;
+                vint lineIndex, lineStart, lineEnd;
                 if (GetLineFromCharPos(comparingCaret, lineIndex, lineStart, lineEnd))
                 {
                     preferFrontSide = true;
@@ -811,7 +1015,7 @@ public:
                 int newIndex, newTrailing;
                 pango_layout_move_cursor_visually(layout, TRUE, bytePos, 0, -1, &newIndex, &newTrailing);
                 if (newIndex < 0) return 0;
-                if (newIndex >= (int)utf8Text.Length()) return textLen;
+                if (newIndex >= (int)textIndex.GetUtf8().Length()) return textLen;
                 preferFrontSide = false;
                 return ByteToCharPos(newIndex) + (newTrailing > 0 ? 1 : 0);
             }
@@ -823,34 +1027,33 @@ public:
                 int newIndex, newTrailing;
                 pango_layout_move_cursor_visually(layout, TRUE, bytePos, 0, 1, &newIndex, &newTrailing);
                 if (newIndex < 0) return 0;
-                if (newIndex >= (int)utf8Text.Length()) return textLen;
+                if (newIndex >= (int)textIndex.GetUtf8().Length()) return textLen;
                 preferFrontSide = true;
                 return ByteToCharPos(newIndex) + (newTrailing > 0 ? 1 : 0);
             }
             case CaretMoveUp:
             {
-                int lineIndex, lineStart, lineEnd;
+                vint lineIndex, lineStart, lineEnd;
                 if (!GetLineFromCharPos(comparingCaret, lineIndex, lineStart, lineEnd)) return comparingCaret;
 
                 if (lineIndex == 0) return comparingCaret;  // Already on first line
 
-                // Get X position of current caret
-                Rect caretBounds = GetCaretBounds(comparingCaret, preferFrontSide);
+                // Keep the X position of current caret
+                int x = GetCaretRect(comparingCaret).x;
                 preferFrontSide = true;
-                return GetCaretFromXWithLine(caretBounds.x1 * PANGO_SCALE, lineIndex - 1);
+                return GetCaretFromXWithLine(x, lineIndex - 1);
             }
             case CaretMoveDown:
             {
-                int lineIndex, lineStart, lineEnd;
+                vint lineIndex, lineStart, lineEnd;
                 if (!GetLineFromCharPos(comparingCaret, lineIndex, lineStart, lineEnd)) return comparingCaret;
 
-                int lineCount = pango_layout_get_line_count(layout);
-                if (lineIndex >= lineCount - 1) return comparingCaret;  // Already on last line
+                if (lineIndex >= lines.Count() - 1) return comparingCaret;  // Already on last line
 
-                // Get X position of current caret
-                Rect caretBounds = GetCaretBounds(comparingCaret, preferFrontSide);
+                // Keep the X position of current caret
+                int x = GetCaretRect(comparingCaret).x;
                 preferFrontSide = false;
-                return GetCaretFromXWithLine(caretBounds.x1 * PANGO_SCALE, lineIndex + 1);
+                return GetCaretFromXWithLine(x, lineIndex + 1);
             }
             default:
                 break;
@@ -861,6 +1064,7 @@ public:
     Rect GetCaretBounds(vint caret, bool frontSide) override
     {
         if (!layout) return Rect();
+        EnsureLayout();
         if (!IsValidCaret(caret)) return Rect();
         if (text.Length() == 0)
         {
@@ -885,11 +1089,8 @@ public:
             return Rect(Point(x, 0), Size(0, s.y > 0 ? s.y : defaultFont.size));
         }
 
-        PangoRectangle strongPos, weakPos;
-        vint bytePos = CharToBytePos(caret);
-        pango_layout_get_cursor_pos(layout, bytePos, &strongPos, &weakPos);
+        PangoRectangle strongPos = GetCaretRect(caret);
 
-        // Use strong position for LTR, could use weak for RTL context
         // Add alignment offset
         return Rect(
             lastAlignOffsetX + strongPos.x / PANGO_SCALE,
@@ -902,17 +1103,14 @@ public:
     vint GetCaretFromPoint(Point point) override
     {
         if (!layout) return -1;
+        EnsureLayout();
 
         // Adjust point for alignment offset
         vint adjustedX = point.x - lastAlignOffsetX;
         if (adjustedX < 0) adjustedX = 0;
 
-        int index, trailing;
-        pango_layout_xy_to_index(layout, adjustedX * PANGO_SCALE, point.y * PANGO_SCALE, &index, &trailing);
-
-        vint charPos = ByteToCharPos(index);
-        if (trailing > 0) charPos++;
-        return charPos;
+        // Points above or below the text hit the first or last line
+        return GetCaretFromXWithLine((int)adjustedX * PANGO_SCALE, FindLineAtY((int)point.y * PANGO_SCALE));
     }
 
     Nullable<InlineObjectProperties> GetInlineObjectFromPoint(Point point, vint& start, vint& length) override
@@ -921,27 +1119,31 @@ public:
         length = 0;
 
         if (!layout) return {};
+        EnsureLayout();
 
-        // First, use Pango to find the text position at this point
+        // First, find the text position at this point through the line index
+        int x = (int)point.x * PANGO_SCALE;
+        int y = (int)point.y * PANGO_SCALE;
+        vint lineIndex = FindLineAtY(y);
         int index, trailing;
-        pango_layout_xy_to_index(layout, point.x * PANGO_SCALE, point.y * PANGO_SCALE, &index, &trailing);
+        pango_layout_line_x_to_index(lines[lineIndex].line, x - lines[lineIndex].left, &index, &trailing);
         vint charPos = ByteToCharPos(index);
 
-        // Check if this position falls within any inline object
-        for (vint i = 0; i < inlineObjects.Count(); i++)
+        // Check if this position falls within any inline object, they are sorted by position
+        vint found = FindInlineObject(charPos);
+        if (found < inlineObjects.Count() && inlineObjects[found].start <= charPos)
         {
-            InlineObject& obj = inlineObjects[i];
-            if (charPos >= obj.start && charPos < obj.start + obj.length)
-            {
-                // Found matching inline object
-                start = obj.start;
-                length = obj.length;
-                return obj.properties;
-            }
+            InlineObject& obj = inlineObjects[found];
+            start = obj.start;
+            length = obj.length;
+            return obj.properties;
         }
 
-        // Also check using cached bounds for better hit testing
-        for (vint i = 0; i < inlineObjects.Count(); i++)
+        // Also check the cached bounds of the other inline objects on the hit line, the caret position
+        // snaps to the nearest character edge and may land just outside an object under the point
+        vint lineStart = ByteToCharPos(lines[lineIndex].startByte);
+        vint lineEnd = ByteToCharPos(lines[lineIndex].endByte);
+        for (vint i = FindInlineObject(lineStart); i < inlineObjects.Count() && inlineObjects[i].start < lineEnd; i++)
         {
             InlineObject& obj = inlineObjects[i];
             if (obj.cachedBounds.Contains(point))
@@ -1037,13 +1239,10 @@ public:
         cairo_t* cr = GetCairoContext();
         if (cr) {
             cairo_save(cr);
-            // Apply HiDPI scaling
-            vl::presentation::wayland::WaylandDisplay* wlDisplay = vl::presentation::wayland::GetWaylandDisplay();
-            if (wlDisplay) {
-                int32_t scale = wlDisplay->GetOutputScale();
-                if (scale > 1) {
-                    cairo_scale(cr, scale, scale);
-                }
+            // Apply HiDPI scaling, which may be fractional
+            double scale = GetScaleFactor();
+            if (scale != 1.0) {
+                cairo_scale(cr, scale, scale);
             }
         }
     }
@@ -1132,6 +1331,21 @@ public:
         return view ? view->GetCairoContext() : nullptr;
     }
 
+    double GetScaleFactor() override
+    {
+        if (window && window->GetRenderScale() > 0) {
+            return window->GetRenderScale();
+        }
+        return 1.0;
+    }
+
+    void RequestRedraw() override
+    {
+        if (window) {
+            window->RedrawContent();
+        }
+    }
+
     bool IsInHostedRendering() override { return false; }
     void StartHostedRendering() override {}
     RenderTargetFailure StopHostedRendering() override { return RenderTargetFailure::None; }
@@ -1168,6 +1382,195 @@ public:
     }
 };
 
+// Shaped label layouts shared by every label renderer showing the same text with the same settings.
+// Entries are reference counted, unreferenced ones stay cached until the byte budget evicts them,
+// least recently released first. Only used from the UI thread.
+class WGacShapedTextCache
+{
+public:
+    static const vint DefaultBudget = 4 * 1024 * 1024;
+
+    struct Key
+    {
+        WString text;
+        FontProperties font;
+        // In Pango units, -1 when the layout is not constrained
+        int width = -1;
+        PangoEllipsizeMode ellipsize = PANGO_ELLIPSIZE_NONE;
+        PangoAlignment alignment = PANGO_ALIGN_LEFT;
+        // Render scale of the measurement context
+        double scale = 1.0;
+
+        bool operator==(const Key& key) const
+        {
+            return width == key.width && ellipsize == key.ellipsize && alignment == key.alignment && scale == key.scale
+                && font == key.font && text == key.text;
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        vuint64_t hash = 0;
+        PangoLayout* layout = nullptr;
+        Size size;
+        vint bytes = 0;
+        vint refCount = 0;
+        // False for the rare entry whose hash collides with a different cached key
+        bool cached = false;
+        // Neighbours in the list of unreferenced entries
+        Entry* previous = nullptr;
+        Entry* next = nullptr;
+    };
+
+    struct Statistics
+    {
+        vint hits = 0;
+        vint misses = 0;
+        vint entries = 0;
+        vint bytes = 0;
+    };
+
+protected:
+    Dictionary<vuint64_t, Entry*> entries;
+    Entry* unusedFirst = nullptr;
+    Entry* unusedLast = nullptr;
+    vint budget;
+    Statistics statistics;
+
+    static vuint64_t HashKey(const Key& key)
+    {
+        using wayland::WGacDecodedImageCache;
+        vuint64_t hash = WGacDecodedImageCache::HashBytes(key.text.Buffer(), key.text.Length() * sizeof(wchar_t));
+        hash = WGacDecodedImageCache::HashBytes(key.font.fontFamily.Buffer(), key.font.fontFamily.Length() * sizeof(wchar_t), hash);
+        vint values[] = { key.font.size, key.font.bold, key.font.italic, key.width, key.ellipsize, key.alignment };
+        hash = WGacDecodedImageCache::HashBytes(values, sizeof(values), hash);
+        return WGacDecodedImageCache::HashBytes(&key.scale, sizeof(key.scale), hash);
+    }
+
+    void Unlink(Entry* entry)
+    {
+        (entry->previous ? entry->previous->next : unusedFirst) = entry->next;
+        (entry->next ? entry->next->previous : unusedLast) = entry->previous;
+        entry->previous = nullptr;
+        entry->next = nullptr;
+    }
+
+    void Append(Entry* entry)
+    {
+        entry->previous = unusedLast;
+        (unusedLast ? unusedLast->next : unusedFirst) = entry;
+        unusedLast = entry;
+    }
+
+    void Destroy(Entry* entry)
+    {
+        if (entry->cached) {
+            entries.Remove(entry->hash);
+            statistics.entries--;
+            statistics.bytes -= entry->bytes;
+        }
+        GetWGacResourceManager()->ReleaseLayout(entry->layout);
+        delete entry;
+    }
+
+    void Evict()
+    {
+        while (statistics.bytes > budget && unusedFirst) {
+            Entry* entry = unusedFirst;
+            Unlink(entry);
+            Destroy(entry);
+        }
+    }
+
+public:
+    WGacShapedTextCache(vint _budget = DefaultBudget)
+        : budget(_budget)
+    {
+    }
+
+    // Drops every unreferenced entry, called by the resource manager before its layout pools go away.
+    // Entries still referenced belong to renderers that outlive the cache, they are left to the process.
+    void Clear()
+    {
+        while (unusedFirst) {
+            Entry* entry = unusedFirst;
+            Unlink(entry);
+            Destroy(entry);
+        }
+    }
+
+    // Returns a referenced entry with the layout already shaped, call Release when done with it
+    Entry* Acquire(const Key& key)
+    {
+        vuint64_t hash = HashKey(key);
+        vint index = entries.Keys().IndexOf(hash);
+        if (index >= 0) {
+            Entry* entry = entries.Values()[index];
+            if (entry->key == key) {
+                if (entry->refCount++ == 0) {
+                    Unlink(entry);
+                }
+                statistics.hits++;
+                return entry;
+            }
+        }
+        statistics.misses++;
+
+        auto entry = new Entry;
+        entry->key = key;
+        entry->hash = hash;
+        entry->refCount = 1;
+        entry->layout = GetWGacResourceManager()->AcquireLayout(key.scale);
+        pango_layout_set_font_description(entry->layout, GetWGacResourceManager()->CreateWGacFont(key.font));
+        pango_layout_set_wrap(entry->layout, PANGO_WRAP_WORD_CHAR);
+        pango_layout_set_width(entry->layout, key.width);
+        pango_layout_set_ellipsize(entry->layout, key.ellipsize);
+        pango_layout_set_alignment(entry->layout, key.alignment);
+        AString text = wayland::EncodeUtf8(key.text);
+        pango_layout_set_text(entry->layout, text.Buffer(), text.Length());
+
+        // Shape now, every later measurement and paint reuses the result
+        int width = 0;
+        int height = 0;
+        pango_layout_get_pixel_size(entry->layout, &width, &height);
+        entry->size = Size(width, height);
+        // An estimate: the layout and its lines, plus items, glyphs and attributes per byte of text
+        entry->bytes = 512 + text.Length() * 48;
+
+        if (index < 0) {
+            entry->cached = true;
+            entries.Add(hash, entry);
+            statistics.entries++;
+            statistics.bytes += entry->bytes;
+            Evict();
+        }
+        return entry;
+    }
+
+    void Release(Entry* entry)
+    {
+        if (!entry || --entry->refCount > 0) return;
+        if (entry->cached) {
+            Append(entry);
+            Evict();
+        } else {
+            Destroy(entry);
+        }
+    }
+
+    void SetBudget(vint bytes)
+    {
+        budget = bytes;
+        Evict();
+    }
+
+    Statistics GetStatistics()
+    {
+        return statistics;
+    }
+};
+
 // WGacResourceManager implementation
 class WGacResourceManager : public GuiGraphicsResourceManager, public INativeControllerListener, public IWGacResourceManager
 {
@@ -1175,6 +1578,44 @@ protected:
     SortedList<Ptr<WGacRenderTarget>> renderTargets;
     Dictionary<WString, PangoFontDescription*> fontCache;
     Ptr<WGacLayoutProvider> layoutProvider;
+    WGacShapedTextCache shapedTextCache;
+
+    // Measurement contexts and the layouts returned to them, creating a PangoContext or a layout per
+    // renderer costs a lot of memory and time when virtualized lists create and destroy items
+    struct MeasurementContext
+    {
+        double scale = 1.0;
+        PangoContext* context = nullptr;
+        List<PangoLayout*> freeLayouts;
+    };
+    static const vint MaxFreeLayouts = 256;
+    List<Ptr<MeasurementContext>> measurementContexts;
+
+    MeasurementContext* FindMeasurementContext(double scale)
+    {
+        for (vint i = 0; i < measurementContexts.Count(); i++) {
+            if (measurementContexts[i]->scale == scale) {
+                return measurementContexts[i].Obj();
+            }
+        }
+
+        auto measurement = Ptr(new MeasurementContext);
+        measurement->scale = scale;
+        measurement->context = pango_font_map_create_context(pango_cairo_font_map_get_default());
+
+        // Same defaults as a context created for an image surface. Metrics hinted to whole logical pixels
+        // land between device pixels at fractional scales, so they are only hinted at integer scales.
+        cairo_font_options_t* options = cairo_font_options_create();
+        if (scale != (vint)scale) {
+            cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+            pango_context_set_round_glyph_positions(measurement->context, FALSE);
+        }
+        pango_cairo_context_set_font_options(measurement->context, options);
+        cairo_font_options_destroy(options);
+
+        measurementContexts.Add(measurement);
+        return measurement.Obj();
+    }
 
 public:
     WGacResourceManager()
@@ -1185,6 +1626,14 @@ public:
 
     ~WGacResourceManager()
     {
+        shapedTextCache.Clear();
+        for (vint i = 0; i < measurementContexts.Count(); i++) {
+            auto measurement = measurementContexts[i];
+            for (vint j = 0; j < measurement->freeLayouts.Count(); j++) {
+                g_object_unref(measurement->freeLayouts[j]);
+            }
+            g_object_unref(measurement->context);
+        }
         for (auto& pair : fontCache) {
             pango_font_description_free(pair.value);
         }
@@ -1253,6 +1702,50 @@ public:
         fontCache.Add(key, font);
         return font;
     }
+
+    WGacShapedTextCache* GetShapedTextCache() override
+    {
+        return &shapedTextCache;
+    }
+
+    PangoContext* GetMeasurementContext(double scale) override
+    {
+        return FindMeasurementContext(scale)->context;
+    }
+
+    PangoLayout* AcquireLayout(double scale) override
+    {
+        auto measurement = FindMeasurementContext(scale);
+        vint count = measurement->freeLayouts.Count();
+        if (count > 0) {
+            PangoLayout* layout = measurement->freeLayouts[count - 1];
+            measurement->freeLayouts.RemoveAt(count - 1);
+            return layout;
+        }
+        return pango_layout_new(measurement->context);
+    }
+
+    void ReleaseLayout(PangoLayout* layout) override
+    {
+        if (!layout) return;
+        PangoContext* context = pango_layout_get_context(layout);
+        for (vint i = 0; i < measurementContexts.Count(); i++) {
+            auto measurement = measurementContexts[i];
+            if (measurement->context == context && measurement->freeLayouts.Count() < MaxFreeLayouts) {
+                // Back to the defaults, nothing is shaped again until the next user sets its text
+                pango_layout_set_attributes(layout, nullptr);
+                pango_layout_set_font_description(layout, nullptr);
+                pango_layout_set_text(layout, "", 0);
+                pango_layout_set_width(layout, -1);
+                pango_layout_set_wrap(layout, PANGO_WRAP_WORD);
+                pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_NONE);
+                pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
+                measurement->freeLayouts.Add(layout);
+                return;
+            }
+        }
+        g_object_unref(layout);
+    }
 };
 
 // Global accessors
@@ -1392,42 +1885,68 @@ class GuiSolidLabelElementRenderer : public GuiElementRendererBase<GuiSolidLabel
 {
     friend class GuiElementRendererBase<GuiSolidLabelElement, GuiSolidLabelElementRenderer, IWGacRenderTarget>;
 
-    PangoLayout* layout = nullptr;
+    // Borrowed from the shared cache, replaced only when the text, font or layout settings change
+    WGacShapedTextCache::Entry* shaped = nullptr;
     WString oldText;
     FontProperties oldFont;
     vint oldMaxWidth = -1;
+    bool shapedFontDirty = true;
 
-    void UpdateMinSize()
+    // Wrapped and ellipsized labels are laid out within the render width, Pango aligns them
+    bool UsesLayoutWidth()
     {
-        if (renderTarget)
+        return element->GetWrapLine() || element->GetEllipse();
+    }
+
+    void SyncLayout(const WString& text, vint maxWidth)
+    {
+        double scale = renderTarget ? renderTarget->GetScaleFactor() : 1.0;
+        int width = UsesLayoutWidth() && maxWidth >= 0 ? (int)maxWidth * PANGO_SCALE : -1;
+        PangoEllipsizeMode ellipsize = element->GetEllipse() ? PANGO_ELLIPSIZE_END : PANGO_ELLIPSIZE_NONE;
+        PangoAlignment alignment = PANGO_ALIGN_LEFT;
+        switch (element->GetHorizontalAlignment()) {
+            case Alignment::Center:
+                alignment = PANGO_ALIGN_CENTER;
+                break;
+            case Alignment::Right:
+                alignment = PANGO_ALIGN_RIGHT;
+                break;
+            default:
+                break;
+        }
+
+        // Copies of the same WString share the buffer, which makes the per-frame check cheap
+        if (shaped && !shapedFontDirty
+            && shaped->key.width == width && shaped->key.ellipsize == ellipsize && shaped->key.alignment == alignment
+            && shaped->key.scale == scale
+            && (shaped->key.text.Buffer() == text.Buffer() || shaped->key.text == text))
         {
-            int text_width = 0;
-            int text_height = 0;
+            return;
+        }
 
-            if (element->GetWrapLine())
-            {
-                if (element->GetWrapLineHeightCalculation())
-                {
-                    if (oldMaxWidth == -1 || oldText.Length() == 0)
-                    {
-                        pango_layout_set_text(layout, "", -1);
-                    }
-                    else
-                    {
-                        pango_layout_set_width(layout, oldMaxWidth * PANGO_SCALE);
-                        AString text = wtoa(oldText);
-                        pango_layout_set_text(layout, text.Buffer(), -1);
-                    }
-                }
-            }
-            else
-            {
-                AString text = wtoa(oldText.Length() == 0 ? L"" : oldText);
-                pango_layout_set_text(layout, text.Buffer(), -1);
-            }
+        WGacShapedTextCache::Key key;
+        key.text = text;
+        key.font = oldFont;
+        key.width = width;
+        key.ellipsize = ellipsize;
+        key.alignment = alignment;
+        key.scale = scale;
+
+        auto cache = GetWGacResourceManager()->GetShapedTextCache();
+        auto entry = cache->Acquire(key);
+        cache->Release(shaped);
+        shaped = entry;
+        shapedFontDirty = false;
+    }
 
-            pango_layout_get_pixel_size(layout, &text_width, &text_height);
-            minSize = Size((element->GetEllipse() ? 0 : text_width), text_height);
+    void UpdateMinSize()
+    {
+        if (renderTarget)
+        {
+            // Until the first render the wrapping width is unknown, a single empty line gives the height
+            bool measureEmpty = element->GetWrapLine() && element->GetWrapLineHeightCalculation() && oldMaxWidth == -1;
+            SyncLayout(measureEmpty ? WString::Empty : oldText, oldMaxWidth);
+            minSize = Size((element->GetEllipse() ? 0 : shaped->size.x), shaped->size.y);
         }
         else
         {
@@ -1437,18 +1956,15 @@ class GuiSolidLabelElementRenderer : public GuiElementRendererBase<GuiSolidLabel
 
     void InitializeInternal()
     {
-        cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-        cairo_t* cr = cairo_create(surface);
-        layout = pango_cairo_create_layout(cr);
-        cairo_destroy(cr);
-        cairo_surface_destroy(surface);
+        oldText = element->GetText();
+        oldFont = element->GetFont();
     }
 
     void FinalizeInternal()
     {
-        if (layout) {
-            g_object_unref(layout);
-            layout = nullptr;
+        if (shaped) {
+            GetWGacResourceManager()->GetShapedTextCache()->Release(shaped);
+            shaped = nullptr;
         }
     }
 
@@ -1461,48 +1977,17 @@ public:
     void Render(Rect bounds) override
     {
         cairo_t* cr = GetCurrentWGacContextFromRenderTarget();
-        if (!cr || !layout) return;
-
-        auto font = GetWGacResourceManager()->CreateWGacFont(element->GetFont());
-        pango_layout_set_font_description(layout, font);
-
-        AString text = wtoa(element->GetText());
-        pango_layout_set_text(layout, text.Buffer(), -1);
-
-        // Set wrap mode and width
-        if (element->GetWrapLine())
-        {
-            pango_layout_set_width(layout, bounds.Width() * PANGO_SCALE);
-            pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-        }
-        else
-        {
-            pango_layout_set_width(layout, -1);
-        }
+        if (!cr) return;
 
-        // Set ellipsize
-        if (element->GetEllipse())
-        {
-            pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
-        }
-        else
+        if (oldMaxWidth != bounds.Width())
         {
-            pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_NONE);
-        }
-
-        // Set Pango alignment for text within the layout
-        PangoAlignment pangoAlign = PANGO_ALIGN_LEFT;
-        switch (element->GetHorizontalAlignment()) {
-            case Alignment::Center:
-                pangoAlign = PANGO_ALIGN_CENTER;
-                break;
-            case Alignment::Right:
-                pangoAlign = PANGO_ALIGN_RIGHT;
-                break;
-            default:
-                break;
+            oldMaxWidth = bounds.Width();
+            if (UsesLayoutWidth())
+            {
+                UpdateMinSize();
+            }
         }
-        pango_layout_set_alignment(layout, pangoAlign);
+        SyncLayout(oldText, oldMaxWidth);
 
         Color c = element->GetColor();
         cairo_set_source_rgba(cr, c.r / 255.0, c.g / 255.0, c.b / 255.0, c.a / 255.0);
@@ -1510,9 +1995,9 @@ public:
         double x = bounds.x1;
         double y = bounds.y1;
 
-        // For wrapped text, Pango handles horizontal alignment within layout width,
-        // so we only adjust x position for non-wrapped text
-        if (!element->GetWrapLine())
+        // When the layout has a width, Pango handles horizontal alignment within it,
+        // so we only adjust x position for unconstrained text
+        if (!UsesLayoutWidth())
         {
             switch (element->GetHorizontalAlignment()) {
                 case Alignment::Center:
@@ -1538,14 +2023,8 @@ public:
                 break;
         }
 
-        if (oldMaxWidth != bounds.Width())
-        {
-            oldMaxWidth = bounds.Width();
-            UpdateMinSize();
-        }
-
         cairo_move_to(cr, x, y);
-        pango_cairo_show_layout(cr, layout);
+        pango_cairo_show_layout(cr, shaped->layout);
     }
 
     void OnElementStateChanged() override
@@ -1555,8 +2034,7 @@ public:
         if (oldFont != font)
         {
             oldFont = font;
-            auto gFont = GetWGacResourceManager()->CreateWGacFont(font);
-            pango_layout_set_font_description(layout, gFont);
+            shapedFontDirty = true;
         }
         UpdateMinSize();
     }
@@ -1780,10 +2258,56 @@ class GuiImageFrameElementRenderer : public GuiElementRendererBase<GuiImageFrame
 {
     friend class GuiElementRendererBase<GuiImageFrameElement, GuiImageFrameElementRenderer, IWGacRenderTarget>;
 
-    void InitializeInternal() {}
-    void FinalizeInternal() {}
+    // Cleared when the renderer goes away, so that an image decoded later does not call back into it
+    struct DecodedToken : public Object
+    {
+        GuiImageFrameElementRenderer* renderer = nullptr;
+    };
+    Ptr<DecodedToken> decodedToken;
+    INativeImage* watchedImage = nullptr;
+    // Whether a callback is queued on watchedImage
+    bool watching = false;
+
+    void InitializeInternal()
+    {
+        WatchDecoding();
+    }
+
+    void FinalizeInternal()
+    {
+        if (decodedToken) {
+            decodedToken->renderer = nullptr;
+        }
+    }
+
     void RenderTargetChangedInternal(IWGacRenderTarget*, IWGacRenderTarget*) {}
 
+    // Images created asynchronously get their pixels later, and so do images whose pixels were dropped
+    // by the memory budget, paint again when they arrive
+    void WatchDecoding()
+    {
+        auto image = dynamic_cast<wayland::WGacImage*>(element->GetImage().Obj());
+        if (!image || (image == watchedImage && watching) || !image->IsDecoding()) return;
+        watchedImage = image;
+        watching = true;
+        if (!decodedToken) {
+            decodedToken = Ptr(new DecodedToken);
+            decodedToken->renderer = this;
+        }
+        auto token = decodedToken;
+        image->OnDecoded([=]()
+        {
+            auto renderer = token->renderer;
+            if (!renderer) return;
+            if (renderer->watchedImage == image) {
+                renderer->watching = false;
+            }
+            if (renderer->renderTarget) {
+                renderer->renderTarget->RequestRedraw();
+            }
+        });
+    }
+
     void UpdateMinSize()
     {
         auto image = element->GetImage();
@@ -1813,7 +2337,11 @@ public:
         if (!wgacFrame) return;
 
         cairo_surface_t* surface = wgacFrame->GetSurface();
-        if (!surface) return;
+        if (!surface) {
+            // GetSurface may have started bringing back pixels dropped by the memory budget
+            WatchDecoding();
+            return;
+        }
 
         Size imageSize = frame->GetSize();
         if (imageSize.x <= 0 || imageSize.y <= 0) return;
@@ -1854,32 +2382,40 @@ public:
 
         cairo_save(cr);
 
-        if (element->GetStretch()) {
-            // Scale to fit
-            double scaleX = w / imageSize.x;
-            double scaleY = h / imageSize.y;
+        // Resample once into a device-sized (and possibly disabled) copy and blit it 1:1 afterwards
+        bool disabled = !element->GetEnabled();
+        double scale = renderTarget ? renderTarget->GetScaleFactor() : 1.0;
+        Size deviceSize((vint)(w * scale + 0.5), (vint)(h * scale + 0.5));
+        cairo_surface_t* variant = wayland::WGacImageFrameVariants::GetOrCreate(wgacFrame)->GetVariant(deviceSize, disabled);
+
+        // Masks carry their disabled look in the paint colour
+        bool mask = cairo_image_surface_get_format(surface) == CAIRO_FORMAT_A8;
+
+        if (variant) {
             cairo_translate(cr, x, y);
-            cairo_scale(cr, scaleX, scaleY);
-            cairo_set_source_surface(cr, surface, 0, 0);
-        } else {
-            cairo_set_source_surface(cr, surface, x, y);
+            cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+            wayland::PaintImageSurface(cr, variant, CAIRO_FILTER_GOOD, mask && disabled);
+            cairo_restore(cr);
+            return;
         }
 
-        cairo_paint(cr);
+        // Too large to cache, scale on the fly
+        cairo_translate(cr, x, y);
+        cairo_scale(cr, w / imageSize.x, h / imageSize.y);
+        wayland::PaintImageSurface(cr, surface, CAIRO_FILTER_GOOD, mask && disabled);
+        cairo_restore(cr);
 
-        // If disabled, apply a gray overlay
-        if (!element->GetEnabled()) {
+        if (disabled && !mask) {
             cairo_set_source_rgba(cr, 1, 1, 1, 0.5);
             cairo_rectangle(cr, x, y, w, h);
             cairo_fill(cr);
         }
-
-        cairo_restore(cr);
     }
 
     void OnElementStateChanged() override
     {
         UpdateMinSize();
+        WatchDecoding();
     }
 };
 
@@ -1,4 +1,6 @@
 #include "WGacClipboardService.h"
+#include "WGacImageService.h"
+#include "WGacTextIndex.h"
 #include "../Wayland/WaylandDisplay.h"
 #include "../Wayland/WaylandSeat.h"
 #include <unistd.h>
@@ -81,70 +83,12 @@ namespace {
         close(fd);
     }
 
-    // Convert WString to UTF-8
+    // Offered text is kept as std::string until a client asks for it
     std::string WStringToUtf8(const WString& wstr) {
-        if (wstr.Length() == 0) return "";
-
-        std::string result;
-        const wchar_t* ptr = wstr.Buffer();
-        size_t len = wstr.Length();
-
-        for (size_t i = 0; i < len; i++) {
-            wchar_t ch = ptr[i];
-            if (ch < 0x80) {
-                result += static_cast<char>(ch);
-            } else if (ch < 0x800) {
-                result += static_cast<char>(0xC0 | (ch >> 6));
-                result += static_cast<char>(0x80 | (ch & 0x3F));
-            } else if (ch < 0x10000) {
-                result += static_cast<char>(0xE0 | (ch >> 12));
-                result += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
-                result += static_cast<char>(0x80 | (ch & 0x3F));
-            } else {
-                result += static_cast<char>(0xF0 | (ch >> 18));
-                result += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
-                result += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
-                result += static_cast<char>(0x80 | (ch & 0x3F));
-            }
-        }
+        std::string result(GetUtf8Length(wstr.Buffer(), wstr.Length()), '\0');
+        EncodeUtf8(wstr.Buffer(), wstr.Length(), result.data());
         return result;
     }
-
-    // Convert UTF-8 to WString
-    WString Utf8ToWString(const std::vector<char>& utf8) {
-        if (utf8.empty()) return L"";
-
-        std::wstring result;
-        const unsigned char* ptr = reinterpret_cast<const unsigned char*>(utf8.data());
-        size_t len = utf8.size();
-
-        for (size_t i = 0; i < len; ) {
-            unsigned char ch = ptr[i];
-            wchar_t wch;
-
-            if ((ch & 0x80) == 0) {
-                wch = ch;
-                i += 1;
-            } else if ((ch & 0xE0) == 0xC0 && i + 1 < len) {
-                wch = ((ch & 0x1F) << 6) | (ptr[i+1] & 0x3F);
-                i += 2;
-            } else if ((ch & 0xF0) == 0xE0 && i + 2 < len) {
-                wch = ((ch & 0x0F) << 12) | ((ptr[i+1] & 0x3F) << 6) | (ptr[i+2] & 0x3F);
-                i += 3;
-            } else if ((ch & 0xF8) == 0xF0 && i + 3 < len) {
-                uint32_t cp = ((ch & 0x07) << 18) | ((ptr[i+1] & 0x3F) << 12) |
-                              ((ptr[i+2] & 0x3F) << 6) | (ptr[i+3] & 0x3F);
-                // For wchar_t on Linux (32-bit), we can store full codepoint
-                wch = static_cast<wchar_t>(cp);
-                i += 4;
-            } else {
-                wch = L'?';
-                i += 1;
-            }
-            result += wch;
-        }
-        return WString(result.c_str());
-    }
 }
 
 // WGacClipboardWriter implementation
@@ -288,7 +232,7 @@ public:
 
         // Read data
         auto data = ReadFromFd(pipefd[0]);
-        return Utf8ToWString(data);
+        return DecodeUtf8(data.data(), (vint)data.size());
     }
 
     bool ContainsDocument() override
@@ -458,9 +402,14 @@ void WGacClipboardService::data_source_send(void* data, wl_data_source* /*source
     if (IsSupportedTextMime(mime_type) && !self->pending_text.empty()) {
         WriteToFd(fd, self->pending_text.c_str(), self->pending_text.size());
     } else if (IsSupportedImageMime(mime_type) && self->pending_image) {
-        // TODO: Encode image to PNG and write to fd
-        // For now just close
-        close(fd);
+        // Stored without compression, the receiver decodes it right away
+        stream::MemoryStream memoryStream;
+        if (auto image = self->pending_image.Cast<WGacImage>()) {
+            image->SaveToStream(memoryStream, INativeImage::Png, WGacPngCompression::Store);
+        } else {
+            self->pending_image->SaveToStream(memoryStream, INativeImage::Png);
+        }
+        WriteToFd(fd, memoryStream.GetInternalBuffer(), (size_t)memoryStream.Size());
     } else {
         close(fd);
     }
@@ -0,0 +1,312 @@
+#include "WGacImageEncoder.h"
+#include "WGacImageService.h"
+#include "WGacPixelKernels.h"
+#include <zlib.h>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace vl {
+namespace presentation {
+namespace wayland {
+
+void SurfaceRowToRgba(cairo_surface_t* surface, const unsigned char* row, int width, unsigned char* rgba)
+{
+    switch (cairo_image_surface_get_format(surface)) {
+        case CAIRO_FORMAT_A8:
+        {
+            Color color;
+            GetImageMaskColor(surface, color);
+            for (int x = 0; x < width; x++) {
+                rgba[x * 4 + 0] = color.r;
+                rgba[x * 4 + 1] = color.g;
+                rgba[x * 4 + 2] = color.b;
+                rgba[x * 4 + 3] = row[x];
+            }
+            break;
+        }
+        case CAIRO_FORMAT_RGB24:
+        {
+            // The unused byte is not guaranteed to be 0xFF
+            auto src = reinterpret_cast<const uint32_t*>(row);
+            auto out = reinterpret_cast<uint32_t*>(rgba);
+            for (int x = 0; x < width; x++) {
+                out[x] = src[x] | 0xFF000000u;
+            }
+            UnpremultiplyToRgba(out, rgba, width);
+            break;
+        }
+        default:
+            UnpremultiplyToRgba(reinterpret_cast<const uint32_t*>(row), rgba, width);
+            break;
+    }
+}
+
+namespace {
+
+// IDAT chunks are this large, so a big image is a few large stream writes
+const vint PngChunkDataSize = 128 * 1024;
+
+enum PngFilter
+{
+    PngFilterNone = 0,
+    PngFilterSub = 1,
+    PngFilterUp = 2,
+    PngFilterAverage = 3,
+    PngFilterPaeth = 4,
+};
+
+void put_be32(unsigned char* target, uint32_t value)
+{
+    target[0] = (unsigned char)(value >> 24);
+    target[1] = (unsigned char)(value >> 16);
+    target[2] = (unsigned char)(value >> 8);
+    target[3] = (unsigned char)value;
+}
+
+// Chunks are assembled in one buffer as length, type, data and CRC, and written with a single call
+class PngChunkWriter
+{
+protected:
+    stream::IStream& stream;
+    std::vector<unsigned char> buffer;
+    bool failed = false;
+
+public:
+    PngChunkWriter(stream::IStream& _stream)
+        : stream(_stream)
+        , buffer(8 + PngChunkDataSize + 4)
+    {
+    }
+
+    unsigned char* GetData()
+    {
+        return buffer.data() + 8;
+    }
+
+    bool Write(const void* data, vint length)
+    {
+        if (!failed && stream.Write(const_cast<void*>(data), length) != length) {
+            failed = true;
+        }
+        return !failed;
+    }
+
+    // The chunk data has been written to GetData()
+    bool WriteChunk(const char* type, vint length)
+    {
+        unsigned char* chunk = buffer.data();
+        put_be32(chunk, (uint32_t)length);
+        memcpy(chunk + 4, type, 4);
+        put_be32(chunk + 8 + length, (uint32_t)crc32(0, chunk + 4, (uInt)(length + 4)));
+        return Write(chunk, length + 12);
+    }
+};
+
+// Feeds the zlib stream and emits an IDAT chunk every time the chunk buffer is full
+class PngDeflater
+{
+protected:
+    PngChunkWriter& writer;
+    z_stream zs;
+    bool initialized = false;
+
+    bool FlushChunk()
+    {
+        vint length = PngChunkDataSize - zs.avail_out;
+        zs.next_out = writer.GetData();
+        zs.avail_out = (uInt)PngChunkDataSize;
+        return length == 0 || writer.WriteChunk("IDAT", length);
+    }
+
+public:
+    PngDeflater(PngChunkWriter& _writer, int level, int strategy)
+        : writer(_writer)
+    {
+        memset(&zs, 0, sizeof(zs));
+        initialized = deflateInit2(&zs, level, Z_DEFLATED, 15, 8, strategy) == Z_OK;
+        zs.next_out = writer.GetData();
+        zs.avail_out = (uInt)PngChunkDataSize;
+    }
+
+    ~PngDeflater()
+    {
+        if (initialized) {
+            deflateEnd(&zs);
+        }
+    }
+
+    bool IsInitialized()
+    {
+        return initialized;
+    }
+
+    bool Deflate(const unsigned char* data, vint length, bool finish)
+    {
+        zs.next_in = const_cast<unsigned char*>(data);
+        zs.avail_in = (uInt)length;
+        while (true) {
+            int result = deflate(&zs, finish ? Z_FINISH : Z_NO_FLUSH);
+            if (result == Z_STREAM_ERROR) return false;
+            bool done = finish ? result == Z_STREAM_END : zs.avail_in == 0 && zs.avail_out != 0;
+            if (zs.avail_out == 0 && !FlushChunk()) return false;
+            if (done) break;
+        }
+        return !finish || FlushChunk();
+    }
+};
+
+inline unsigned char paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (unsigned char)a;
+    if (pb <= pc) return (unsigned char)b;
+    return (unsigned char)c;
+}
+
+// Writes the filter type byte followed by the filtered row
+void filter_row(PngFilter filter, const unsigned char* current, const unsigned char* previous, vint length, vint bpp, unsigned char* target)
+{
+    target[0] = (unsigned char)filter;
+    target++;
+    switch (filter) {
+        case PngFilterNone:
+            memcpy(target, current, length);
+            break;
+        case PngFilterSub:
+            for (vint i = 0; i < length; i++) {
+                target[i] = (unsigned char)(current[i] - (i >= bpp ? current[i - bpp] : 0));
+            }
+            break;
+        case PngFilterUp:
+            for (vint i = 0; i < length; i++) {
+                target[i] = (unsigned char)(current[i] - previous[i]);
+            }
+            break;
+        case PngFilterAverage:
+            for (vint i = 0; i < length; i++) {
+                int left = i >= bpp ? current[i - bpp] : 0;
+                target[i] = (unsigned char)(current[i] - ((left + previous[i]) >> 1));
+            }
+            break;
+        case PngFilterPaeth:
+            for (vint i = 0; i < length; i++) {
+                int left = i >= bpp ? current[i - bpp] : 0;
+                int upperLeft = i >= bpp ? previous[i - bpp] : 0;
+                target[i] = (unsigned char)(current[i] - paeth_predictor(left, previous[i], upperLeft));
+            }
+            break;
+    }
+}
+
+// The usual heuristic: the filter whose output bytes, read as signed, are closest to zero compresses best
+vuint64_t filter_cost(const unsigned char* filtered, vint length)
+{
+    vuint64_t cost = 0;
+    for (vint i = 0; i < length; i++) {
+        cost += (vuint64_t)abs((int)(signed char)filtered[i]);
+    }
+    return cost;
+}
+
+}
+
+bool EncodePng(cairo_surface_t* surface, stream::IStream& stream, WGacPngCompression compression)
+{
+    if (!surface || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) return false;
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    if (width <= 0 || height <= 0) return false;
+
+    cairo_surface_flush(surface);
+    const unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    bool opaque = cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24;
+    vint bpp = opaque ? 3 : 4;
+    vint rowBytes = width * bpp;
+
+    int level = Z_DEFAULT_COMPRESSION;
+    int strategy = Z_FILTERED;
+    switch (compression) {
+        case WGacPngCompression::Store:
+            level = Z_NO_COMPRESSION;
+            strategy = Z_DEFAULT_STRATEGY;
+            break;
+        case WGacPngCompression::Fast:
+            level = Z_BEST_SPEED;
+            strategy = Z_RLE;
+            break;
+        case WGacPngCompression::Default:
+            break;
+        case WGacPngCompression::Best:
+            level = Z_BEST_COMPRESSION;
+            break;
+    }
+
+    PngChunkWriter writer(stream);
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (!writer.Write(signature, sizeof(signature))) return false;
+
+    unsigned char* header = writer.GetData();
+    put_be32(header, (uint32_t)width);
+    put_be32(header + 4, (uint32_t)height);
+    header[8] = 8;                  // bit depth
+    header[9] = opaque ? 2 : 6;     // truecolour, with alpha unless opaque
+    header[10] = 0;                 // deflate
+    header[11] = 0;                 // adaptive filtering
+    header[12] = 0;                 // no interlace
+    if (!writer.WriteChunk("IHDR", 13)) return false;
+
+    PngDeflater deflater(writer, level, strategy);
+    if (!deflater.IsInitialized()) return false;
+
+    // Only the current and the previous converted rows are kept, plus one filtered row per candidate filter
+    std::vector<unsigned char> current(rowBytes), previous(rowBytes, 0);
+    std::vector<uint32_t> opaqueRow(opaque ? width : 0);
+    bool adaptive = compression == WGacPngCompression::Default || compression == WGacPngCompression::Best;
+    vint candidateCount = adaptive ? 5 : 1;
+    std::vector<unsigned char> filtered((rowBytes + 1) * candidateCount);
+
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = data + y * stride;
+        if (opaque) {
+            auto src = reinterpret_cast<const uint32_t*>(row);
+            for (int x = 0; x < width; x++) {
+                opaqueRow[x] = src[x] | 0xFF000000u;
+            }
+            UnpremultiplyToRgb(opaqueRow.data(), current.data(), width);
+        } else {
+            SurfaceRowToRgba(surface, row, width, current.data());
+        }
+
+        const unsigned char* output = filtered.data();
+        if (adaptive) {
+            vuint64_t bestCost = 0;
+            for (vint i = 0; i < candidateCount; i++) {
+                unsigned char* target = filtered.data() + i * (rowBytes + 1);
+                filter_row((PngFilter)i, current.data(), previous.data(), rowBytes, bpp, target);
+                vuint64_t cost = filter_cost(target + 1, rowBytes);
+                if (i == 0 || cost < bestCost) {
+                    bestCost = cost;
+                    output = target;
+                }
+            }
+        } else {
+            PngFilter filter = compression == WGacPngCompression::Store ? PngFilterNone : PngFilterUp;
+            filter_row(filter, current.data(), previous.data(), rowBytes, bpp, filtered.data());
+        }
+
+        if (!deflater.Deflate(output, rowBytes + 1, false)) return false;
+        current.swap(previous);
+    }
+
+    if (!deflater.Deflate(nullptr, 0, true)) return false;
+    return writer.WriteChunk("IEND", 0);
+}
+
+}
+}
+}
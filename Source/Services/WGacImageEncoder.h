@@ -0,0 +1,31 @@
+#ifndef WGAC_IMAGEENCODER_H
+#define WGAC_IMAGEENCODER_H
+
+#include "GacUI.h"
+#include <cairo/cairo.h>
+
+namespace vl {
+namespace presentation {
+namespace wayland {
+
+// PNG compression effort, from the largest and fastest output to the smallest and slowest
+enum class WGacPngCompression
+{
+    Store,      // no filtering and no compression, for short lived copies such as the clipboard
+    Fast,       // one cheap filter for every row and run-length deflate
+    Default,    // adaptive filtering and zlib's default level
+    Best,       // adaptive filtering and zlib's highest level
+};
+
+// Converts a row of an ARGB32, RGB24 or A8 image surface to straight RGBA bytes
+extern void SurfaceRowToRgba(cairo_surface_t* surface, const unsigned char* row, int width, unsigned char* rgba);
+
+// Encodes the surface as PNG, converting rows as they are compressed and writing the stream in large chunks.
+// Opaque surfaces are written without alpha. Returns false if the stream stopped accepting data.
+extern bool EncodePng(cairo_surface_t* surface, stream::IStream& stream, WGacPngCompression compression);
+
+}
+}
+}
+
+#endif // WGAC_IMAGEENCODER_H
@@ -1,4 +1,6 @@
 #include "WGacImageService.h"
+#include "WGacPixelKernels.h"
+#include "WGacImageEncoder.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_NO_STDIO
@@ -8,9 +10,18 @@
 #define STBI_WRITE_NO_STDIO
 #include "../ThirdParty/stb_image_write.h"
 
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <fstream>
-#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace vl {
 namespace presentation {
@@ -27,121 +38,2090 @@ static void copy_rgba_to_surface(const unsigned char* pixels, int width, int hei
     for (int y = 0; y < height; y++) {
         const unsigned char* src_row = pixels + y * width * 4;
         uint32_t* dest_row = (uint32_t*)(dest + y * dest_stride);
+        PremultiplyRgba(src_row, dest_row, width);
+    }
+
+    cairo_surface_mark_dirty(surface);
+}
+
+// Collects stb_image_write's small pieces and writes them to the stream in large chunks
+class StbStreamWriter
+{
+protected:
+    stream::IStream& stream;
+    std::vector<unsigned char> buffer;
+    bool failed = false;
+
+public:
+    static const vint ChunkSize = 128 * 1024;
+
+    StbStreamWriter(stream::IStream& _stream)
+        : stream(_stream)
+    {
+        buffer.reserve(ChunkSize);
+    }
+
+    void Append(const void* data, int size)
+    {
+        auto bytes = static_cast<const unsigned char*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        if ((vint)buffer.size() >= ChunkSize) {
+            Flush();
+        }
+    }
+
+    bool Flush()
+    {
+        if (!failed && !buffer.empty() && stream.Write(buffer.data(), (vint)buffer.size()) != (vint)buffer.size()) {
+            failed = true;
+        }
+        buffer.clear();
+        return !failed;
+    }
+};
+
+static void stbi_write_callback(void* context, void* data, int size)
+{
+    static_cast<StbStreamWriter*>(context)->Append(data, size);
+}
+
+// Bytes of pixels a surface owns, packed surfaces share the stride of their atlas page
+static vint surface_bytes(cairo_surface_t* surface)
+{
+    return (vint)cairo_format_stride_for_width(cairo_image_surface_get_format(surface), cairo_image_surface_get_width(surface))
+        * cairo_image_surface_get_height(surface);
+}
+
+static cairo_user_data_key_t stbPixelsKey;
+
+static void free_stb_pixels(void* pixels)
+{
+    stbi_image_free(pixels);
+}
+
+static cairo_user_data_key_t maskColorKey;
+
+void SetImageMaskColor(cairo_surface_t* surface, Color color)
+{
+    // Stored in the pointer itself, the alpha bit keeps black from reading as "no colour"
+    uintptr_t value = 0xFF000000u | ((uintptr_t)color.r << 16) | ((uintptr_t)color.g << 8) | color.b;
+    cairo_surface_set_user_data(surface, &maskColorKey, reinterpret_cast<void*>(value), nullptr);
+}
+
+bool GetImageMaskColor(cairo_surface_t* surface, Color& color)
+{
+    uintptr_t value = reinterpret_cast<uintptr_t>(cairo_surface_get_user_data(surface, &maskColorKey));
+    if (!value) return false;
+    color = Color((unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value);
+    return true;
+}
+
+// The disabled look of a single colour mask, matching DisablePixels
+static Color disable_mask_color(Color color)
+{
+    unsigned char c = (unsigned char)((((color.r * 77 + color.g * 150 + color.b * 29 + 128) >> 8) + 255) >> 1);
+    return Color(c, c, c);
+}
+
+// Paints a packed image from its atlas page, only when it lands on whole device pixels,
+// a filtered or scaled draw would sample the neighbouring images
+static bool paint_atlas_region(cairo_t* cr, cairo_surface_t* surface, bool disabled)
+{
+    cairo_surface_t* page = nullptr;
+    Rect region;
+    if (!WGacImageAtlas::GetRegion(surface, page, region)) return false;
+
+    cairo_matrix_t matrix;
+    cairo_get_matrix(cr, &matrix);
+    // Undoing a fractional scale leaves rounding errors far below a pixel
+    const double epsilon = 1e-6;
+    if (std::fabs(matrix.xx - 1) > epsilon || std::fabs(matrix.yy - 1) > epsilon
+        || std::fabs(matrix.xy) > epsilon || std::fabs(matrix.yx) > epsilon
+        || std::fabs(matrix.x0 - std::round(matrix.x0)) > epsilon || std::fabs(matrix.y0 - std::round(matrix.y0)) > epsilon) {
+        return false;
+    }
+
+    switch (cairo_image_surface_get_format(page)) {
+        case CAIRO_FORMAT_A8:
+        {
+            Color color;
+            GetImageMaskColor(surface, color);
+            if (disabled) color = disable_mask_color(color);
+            cairo_save(cr);
+            cairo_rectangle(cr, 0, 0, region.Width(), region.Height());
+            cairo_clip(cr);
+            cairo_set_source_rgb(cr, color.r / 255.0, color.g / 255.0, color.b / 255.0);
+            cairo_mask_surface(cr, page, -region.x1, -region.y1);
+            cairo_restore(cr);
+            break;
+        }
+        case CAIRO_FORMAT_RGB24:
+        {
+            cairo_operator_t op = cairo_get_operator(cr);
+            cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+            cairo_set_source_surface(cr, page, -region.x1, -region.y1);
+            cairo_rectangle(cr, 0, 0, region.Width(), region.Height());
+            cairo_fill(cr);
+            cairo_set_operator(cr, op);
+            break;
+        }
+        default:
+            cairo_set_source_surface(cr, page, -region.x1, -region.y1);
+            cairo_rectangle(cr, 0, 0, region.Width(), region.Height());
+            cairo_fill(cr);
+            break;
+    }
+    return true;
+}
+
+void PaintImageSurface(cairo_t* cr, cairo_surface_t* surface, cairo_filter_t filter, bool disabled)
+{
+    if (paint_atlas_region(cr, surface, disabled)) return;
+
+    switch (cairo_image_surface_get_format(surface)) {
+        case CAIRO_FORMAT_A8:
+        {
+            Color color;
+            GetImageMaskColor(surface, color);
+            if (disabled) color = disable_mask_color(color);
+            cairo_set_source_rgb(cr, color.r / 255.0, color.g / 255.0, color.b / 255.0);
+            cairo_pattern_t* mask = cairo_pattern_create_for_surface(surface);
+            cairo_pattern_set_filter(mask, filter);
+            cairo_mask(cr, mask);
+            cairo_pattern_destroy(mask);
+            break;
+        }
+        case CAIRO_FORMAT_RGB24:
+        {
+            // Nothing shows through an opaque image, so it replaces the destination without blending.
+            // PAD keeps filtered edges opaque, SOURCE would otherwise write their transparency.
+            cairo_operator_t op = cairo_get_operator(cr);
+            cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+            cairo_set_source_surface(cr, surface, 0, 0);
+            cairo_pattern_set_filter(cairo_get_source(cr), filter);
+            cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+            cairo_rectangle(cr, 0, 0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
+            cairo_fill(cr);
+            cairo_set_operator(cr, op);
+            break;
+        }
+        default:
+            cairo_set_source_surface(cr, surface, 0, 0);
+            cairo_pattern_set_filter(cairo_get_source(cr), filter);
+            cairo_paint(cr);
+            break;
+    }
+}
+
+// Decode an encoded image into a surface.
+// Opaque images become RGB24 and images of a single colour become A8 masks, unless compact is false.
+// Otherwise the pixels are converted in place inside stb's buffer, which then becomes the surface's memory.
+static cairo_surface_t* decode_to_surface(const unsigned char* buffer, vint length, bool compact = true)
+{
+    int width, height, channels;
+    unsigned char* pixels = stbi_load_from_memory(
+        buffer,
+        static_cast<int>(length),
+        &width, &height, &channels, 4  // Force RGBA
+    );
+
+    if (!pixels) {
+        return nullptr;
+    }
+
+    uint32_t color = 0;
+    RgbaContent content = compact ? ClassifyRgba(pixels, (size_t)width * height, color) : RgbaContent::General;
+
+    if (content == RgbaContent::SingleColor) {
+        // A quarter of the memory, the colour is applied when painting
+        cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_A8, width, height);
+        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+            cairo_surface_destroy(surface);
+            stbi_image_free(pixels);
+            return nullptr;
+        }
+        unsigned char* data = cairo_image_surface_get_data(surface);
+        int maskStride = cairo_image_surface_get_stride(surface);
+        for (int y = 0; y < height; y++) {
+            const unsigned char* src = pixels + (size_t)y * width * 4;
+            unsigned char* dst = data + (size_t)y * maskStride;
+            for (int x = 0; x < width; x++) {
+                dst[x] = src[x * 4 + 3];
+            }
+        }
+        cairo_surface_mark_dirty(surface);
+        stbi_image_free(pixels);
+        SetImageMaskColor(surface, Color((unsigned char)(color >> 16), (unsigned char)(color >> 8), (unsigned char)color));
+        return surface;
+    }
+
+    // RGB24 has the same layout with the alpha byte ignored, so the buffer serves both formats
+    cairo_format_t format = content == RgbaContent::Opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+    int stride = width * 4;
+    if (cairo_format_stride_for_width(format, width) == stride) {
+        PremultiplyRgba(pixels, reinterpret_cast<uint32_t*>(pixels), (size_t)width * height);
+        cairo_surface_t* surface = cairo_image_surface_create_for_data(pixels, format, width, height, stride);
+        if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS &&
+            cairo_surface_set_user_data(surface, &stbPixelsKey, pixels, &free_stb_pixels) == CAIRO_STATUS_SUCCESS) {
+            return surface;
+        }
+        cairo_surface_destroy(surface);
+        stbi_image_free(pixels);
+        return nullptr;
+    }
+
+    cairo_surface_t* surface = cairo_image_surface_create(format, width, height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        stbi_image_free(pixels);
+        return nullptr;
+    }
+
+    copy_rgba_to_surface(pixels, width, height, surface);
+    stbi_image_free(pixels);
+    return surface;
+}
+
+// Identify the container format from the signature
+static INativeImage::FormatType detect_format(const unsigned char* data, vint length)
+{
+    if (length >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) return INativeImage::Png;
+    if (length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) return INativeImage::Jpeg;
+    if (length >= 6 && (memcmp(data, "GIF87a", 6) == 0 || memcmp(data, "GIF89a", 6) == 0)) return INativeImage::Gif;
+    if (length >= 2 && data[0] == 'B' && data[1] == 'M') return INativeImage::Bmp;
+    return INativeImage::Unknown;
+}
+
+// Largest size within maxSize with the aspect ratio of size, an empty maxSize means no limit
+static Size fit_size(Size size, Size maxSize)
+{
+    if (maxSize.x <= 0 || maxSize.y <= 0) return size;
+    if (size.x <= maxSize.x && size.y <= maxSize.y) return size;
+    double scale = (double)maxSize.x / size.x < (double)maxSize.y / size.y
+        ? (double)maxSize.x / size.x
+        : (double)maxSize.y / size.y;
+    vint width = (vint)(size.x * scale + 0.5);
+    vint height = (vint)(size.y * scale + 0.5);
+    return Size(width < 1 ? 1 : width, height < 1 ? 1 : height);
+}
+
+static void on_pixbuf_size_prepared(GdkPixbufLoader* loader, gint width, gint height, gpointer data)
+{
+    Size size = fit_size(Size(width, height), *static_cast<Size*>(data));
+    if (size.x != width || size.y != height) {
+        gdk_pixbuf_loader_set_size(loader, (int)size.x, (int)size.y);
+    }
+}
+
+// The gdk-pixbuf JPEG loader picks the libjpeg scale_denom from the requested size,
+// so the DCT only produces the reduced image
+static cairo_surface_t* decode_jpeg_at_size(const unsigned char* buffer, vint length, Size maxSize)
+{
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new_with_type("jpeg", nullptr);
+    if (!loader) return nullptr;
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(on_pixbuf_size_prepared), &maxSize);
+
+    bool written = gdk_pixbuf_loader_write(loader, buffer, (gsize)length, nullptr);
+    bool closed = gdk_pixbuf_loader_close(loader, nullptr);
+    GdkPixbuf* pixbuf = written && closed ? gdk_pixbuf_loader_get_pixbuf(loader) : nullptr;
+
+    cairo_surface_t* surface = nullptr;
+    if (pixbuf && gdk_pixbuf_get_bits_per_sample(pixbuf) == 8) {
+        int width = gdk_pixbuf_get_width(pixbuf);
+        int height = gdk_pixbuf_get_height(pixbuf);
+        int channels = gdk_pixbuf_get_n_channels(pixbuf);
+        int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+        const guint8* pixels = gdk_pixbuf_read_pixels(pixbuf);
+
+        surface = cairo_image_surface_create(channels == 3 ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32, width, height);
+        if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS && (channels == 3 || channels == 4)) {
+            unsigned char* data = cairo_image_surface_get_data(surface);
+            int stride = cairo_image_surface_get_stride(surface);
+            for (int y = 0; y < height; y++) {
+                const guint8* src = pixels + (size_t)y * rowstride;
+                uint32_t* dst = reinterpret_cast<uint32_t*>(data + (size_t)y * stride);
+                if (channels == 3) {
+                    ExpandRgb(src, dst, width);
+                } else {
+                    PremultiplyRgba(src, dst, width);
+                }
+            }
+            cairo_surface_mark_dirty(surface);
+        } else {
+            cairo_surface_destroy(surface);
+            surface = nullptr;
+        }
+    }
+    g_object_unref(loader);
+    return surface;
+}
+
+// Decode an encoded image into a surface that fits in maxSize.
+// Runs on any thread, the result is packed into the atlas by the UI thread when an image takes it.
+static cairo_surface_t* decode_to_surface_at_size(const unsigned char* buffer, vint length, Size maxSize)
+{
+    if (maxSize.x <= 0 || maxSize.y <= 0) {
+        return decode_to_surface(buffer, length);
+    }
+
+    int width, height, channels;
+    if (!stbi_info_from_memory(buffer, static_cast<int>(length), &width, &height, &channels)) {
+        return nullptr;
+    }
+    Size target = fit_size(Size(width, height), maxSize);
+    if (target == Size(width, height)) {
+        return decode_to_surface(buffer, length);
+    }
+
+    if (detect_format(buffer, length) == INativeImage::Jpeg) {
+        if (auto surface = decode_jpeg_at_size(buffer, length, maxSize)) {
+            return surface;
+        }
+    }
+
+    // Other formats have no reduced decode, the full size pixels only live until they are averaged down
+    cairo_surface_t* source = decode_to_surface(buffer, length, false);
+    if (!source) return nullptr;
+    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (int)target.x, (int)target.y);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        cairo_surface_destroy(source);
+        return nullptr;
+    }
+    cairo_surface_flush(source);
+    DownsampleBox(
+        cairo_image_surface_get_data(source), width, height, cairo_image_surface_get_stride(source),
+        cairo_image_surface_get_data(surface), (int)target.x, (int)target.y, cairo_image_surface_get_stride(surface)
+    );
+    cairo_surface_mark_dirty(surface);
+    cairo_surface_destroy(source);
+    return surface;
+}
+
+// Called on the UI thread, small images are packed into the shared atlas
+static cairo_surface_t* pack_surface(cairo_surface_t* surface)
+{
+    return WGacImageAtlas::GetShared()->Pack(surface);
+}
+
+// WGacImageAtlas implementation
+struct WGacImageAtlas::Page : public Object
+{
+    struct Shelf
+    {
+        vint y = 0;
+        vint height = 0;
+        vint x = 0;
+    };
+
+    SpinLock lock;
+    cairo_surface_t* surface = nullptr;
+    collections::List<Shelf> shelves;
+    // Rectangles of released images, reused by images of the same size
+    collections::List<Rect> released;
+    vint bottom = 0;
+    // Packed images still using the page
+    vint slots = 0;
+
+    ~Page()
+    {
+        if (surface) {
+            cairo_surface_destroy(surface);
+        }
+    }
+
+    vint FindShelf(vint width, vint height, vint maxHeight)
+    {
+        vint best = -1;
+        for (vint i = 0; i < shelves.Count(); i++) {
+            const Shelf& shelf = shelves[i];
+            if (shelf.height >= height && shelf.height <= maxHeight && shelf.x + width <= PageSize) {
+                if (best == -1 || shelf.height < shelves[best].height) {
+                    best = i;
+                }
+            }
+        }
+        return best;
+    }
+
+    // Called with the lock held
+    bool Allocate(vint width, vint height, Rect& region)
+    {
+        for (vint i = 0; i < released.Count(); i++) {
+            if (released[i].Width() == width && released[i].Height() == height) {
+                region = released[i];
+                released.RemoveAt(i);
+                return true;
+            }
+        }
+
+        // Avoid putting short images on tall shelves while the page still has room for a new shelf
+        vint index = FindShelf(width, height, height + height / 2);
+        if (index == -1 && bottom + height <= PageSize) {
+            Shelf shelf;
+            shelf.y = bottom;
+            shelf.height = height;
+            bottom += height;
+            index = shelves.Add(shelf);
+        }
+        if (index == -1) {
+            index = FindShelf(width, height, PageSize);
+        }
+        if (index == -1) return false;
+
+        Shelf& shelf = shelves[index];
+        region = Rect(shelf.x, shelf.y, shelf.x + width, shelf.y + height);
+        shelf.x += width;
+        return true;
+    }
+};
+
+struct WGacImageAtlas::Slot : public Object
+{
+    WGacImageAtlas* atlas = nullptr;
+    Ptr<Page> page;
+    Rect region;
+};
+
+static cairo_user_data_key_t atlasSlotKey;
+
+void WGacImageAtlas::ReleaseSlot(void* data)
+{
+    auto slot = static_cast<Slot*>(data);
+    SPIN_LOCK(slot->atlas->lock)
+    {
+        SPIN_LOCK(slot->page->lock)
+        {
+            slot->page->released.Add(slot->region);
+            if (--slot->page->slots == 0) {
+                slot->atlas->pages.Remove(slot->page);
+            }
+        }
+    }
+    delete slot;
+}
+
+cairo_surface_t* WGacImageAtlas::Pack(cairo_surface_t* surface)
+{
+    if (!surface) return nullptr;
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    if (width <= 0 || height <= 0 || width > MaxPackedSize || height > MaxPackedSize) {
+        return surface;
+    }
+    if (cairo_surface_get_user_data(surface, &atlasSlotKey)) {
+        return surface;
+    }
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_A8) {
+        return surface;
+    }
+
+    Ptr<Page> page;
+    Rect region;
+    SPIN_LOCK(lock)
+    {
+        for (vint i = pages.Count() - 1; i >= 0 && !page; i--) {
+            auto candidate = pages[i];
+            if (cairo_image_surface_get_format(candidate->surface) == format) {
+                SPIN_LOCK(candidate->lock)
+                {
+                    if (candidate->Allocate(width, height, region)) {
+                        candidate->slots++;
+                        page = candidate;
+                    }
+                }
+            }
+        }
+        if (!page) {
+            auto created = Ptr(new Page);
+            created->surface = cairo_image_surface_create(format, PageSize, PageSize);
+            if (cairo_surface_status(created->surface) == CAIRO_STATUS_SUCCESS && created->Allocate(width, height, region)) {
+                created->slots = 1;
+                pages.Add(created);
+                page = created;
+            }
+        }
+    }
+    if (!page) return surface;
+
+    // Only the UI thread packs and paints, so a page is never drawn while it is being written
+    int bytesPerPixel = format == CAIRO_FORMAT_A8 ? 1 : 4;
+    int pageStride = cairo_image_surface_get_stride(page->surface);
+    unsigned char* target = cairo_image_surface_get_data(page->surface) + region.y1 * pageStride + region.x1 * bytesPerPixel;
+    cairo_surface_flush(surface);
+    const unsigned char* source = cairo_image_surface_get_data(surface);
+    int sourceStride = cairo_image_surface_get_stride(surface);
+    for (int y = 0; y < height; y++) {
+        memcpy(target + y * pageStride, source + y * sourceStride, width * bytesPerPixel);
+    }
+    cairo_surface_mark_dirty_rectangle(page->surface, (int)region.x1, (int)region.y1, width, height);
+
+    cairo_surface_t* packed = cairo_image_surface_create_for_data(target, format, width, height, pageStride);
+    auto slot = new Slot;
+    slot->atlas = this;
+    slot->page = page;
+    slot->region = region;
+    cairo_surface_set_user_data(packed, &atlasSlotKey, slot, &ReleaseSlot);
+    Color color;
+    if (format == CAIRO_FORMAT_A8 && GetImageMaskColor(surface, color)) {
+        SetImageMaskColor(packed, color);
+    }
+    cairo_surface_destroy(surface);
+    return packed;
+}
+
+bool WGacImageAtlas::GetRegion(cairo_surface_t* surface, cairo_surface_t*& page, Rect& region)
+{
+    auto slot = static_cast<Slot*>(cairo_surface_get_user_data(surface, &atlasSlotKey));
+    if (!slot) return false;
+    page = slot->page->surface;
+    region = slot->region;
+    return true;
+}
+
+WGacImageAtlas* WGacImageAtlas::GetShared()
+{
+    static WGacImageAtlas atlas;
+    return &atlas;
+}
+
+// WGacEncodedImage implementation
+Ptr<WGacEncodedImage> WGacEncodedImage::ReadFile(const WString& path)
+{
+    AString apath = wtoa(path);
+    int fd = open(apath.Buffer(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    Ptr<WGacEncodedImage> encoded(new WGacEncodedImage);
+    auto& buffer = encoded->buffer;
+    // One extra byte so that hitting the end does not grow the buffer
+    buffer.resize((size_t)st.st_size + 1);
+    size_t used = 0;
+    while (true) {
+        if (used == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        ssize_t bytesRead = read(fd, buffer.data() + used, buffer.size() - used);
+        if (bytesRead <= 0) break;
+        used += bytesRead;
+    }
+    close(fd);
+
+    if (used == 0) return nullptr;
+    buffer.resize(used);
+    return encoded;
+}
+
+Ptr<WGacEncodedImage> WGacEncodedImage::ReadFileHead(const WString& path, vint length)
+{
+    AString apath = wtoa(path);
+    int fd = open(apath.Buffer(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    Ptr<WGacEncodedImage> encoded(new WGacEncodedImage);
+    auto& buffer = encoded->buffer;
+    buffer.resize(length);
+    size_t used = 0;
+    while (used < buffer.size()) {
+        ssize_t bytesRead = read(fd, buffer.data() + used, buffer.size() - used);
+        if (bytesRead <= 0) break;
+        used += bytesRead;
+    }
+    close(fd);
+
+    if (used == 0) return nullptr;
+    buffer.resize(used);
+    return encoded;
+}
+
+Ptr<WGacEncodedImage> WGacEncodedImage::CopyMemory(const void* data, vint length)
+{
+    if (!data || length <= 0) return nullptr;
+    Ptr<WGacEncodedImage> encoded(new WGacEncodedImage);
+    auto bytes = static_cast<const unsigned char*>(data);
+    encoded->buffer.assign(bytes, bytes + length);
+    return encoded;
+}
+
+Ptr<WGacEncodedImage> WGacEncodedImage::ReadStream(stream::IStream& imageStream)
+{
+    Ptr<WGacEncodedImage> encoded(new WGacEncodedImage);
+    auto& buffer = encoded->buffer;
+
+    size_t capacity = 64 * 1024;
+    if (imageStream.CanSeek()) {
+        pos_t size = imageStream.Size();
+        pos_t position = imageStream.Position();
+        if (size > 0 && position >= 0 && size > position) {
+            // One extra byte so that hitting the end does not grow the buffer
+            capacity = (size_t)(size - position) + 1;
+        }
+    }
+
+    size_t used = 0;
+    buffer.resize(capacity);
+    while (true) {
+        if (used == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        vint bytesRead = imageStream.Read(buffer.data() + used, buffer.size() - used);
+        if (bytesRead <= 0) break;
+        used += bytesRead;
+    }
+
+    if (used == 0) return nullptr;
+    buffer.resize(used);
+    return encoded;
+}
+
+const unsigned char* WGacEncodedImage::GetData() const
+{
+    return buffer.data();
+}
+
+vint WGacEncodedImage::GetLength() const
+{
+    return (vint)buffer.size();
+}
+
+// WGacDecodedImageCache implementation
+static inline vuint64_t hash_mix(vuint64_t a, vuint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (vuint64_t)r ^ (vuint64_t)(r >> 64);
+}
+
+vuint64_t WGacDecodedImageCache::HashBytes(const void* data, vint length, vuint64_t seed)
+{
+    const vuint64_t k0 = 0xa0761d6478bd642fULL;
+    const vuint64_t k1 = 0xe7037ed1a0b428dbULL;
+    auto bytes = static_cast<const unsigned char*>(data);
+
+    vuint64_t h = seed ^ k0;
+    vint i = 0;
+    for (; i + 8 <= length; i += 8) {
+        vuint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = hash_mix(h ^ word, k1);
+    }
+    if (i < length) {
+        vuint64_t word = 0;
+        memcpy(&word, bytes + i, length - i);
+        h = hash_mix(h ^ word, k0);
+    }
+    return hash_mix(h ^ (vuint64_t)length, k1);
+}
+
+WGacDecodedImageCache::~WGacDecodedImageCache()
+{
+    for (vint i = 0; i < entries.Count(); i++) {
+        cairo_surface_destroy(entries.Values()[i].surface);
+    }
+}
+
+bool WGacDecodedImageCache::Lookup(vuint64_t key, Entry& entry)
+{
+    SPIN_LOCK(lock)
+    {
+        vint index = entries.Keys().IndexOf(key);
+        if (index != -1) {
+            statistics.hits++;
+            entry = entries.Values()[index];
+            // Prefetched pixels are decoded on the thread pool and join the atlas when first looked up,
+            // which may be after a worker reserved them, packed pixels are returned as they are
+            entry.surface = pack_surface(entry.surface);
+            entry.users++;
+            entries.Set(key, entry);
+            cairo_surface_reference(entry.surface);
+            return true;
+        }
+        statistics.misses++;
+    }
+    return false;
+}
+
+bool WGacDecodedImageCache::Insert(vuint64_t key, const Entry& _entry, bool use)
+{
+    if (!_entry.surface) return false;
+    SPIN_LOCK(lock)
+    {
+        if (entries.Keys().Contains(key)) {
+            return false;
+        }
+        Entry entry = _entry;
+        cairo_surface_reference(entry.surface);
+        entry.bytes = surface_bytes(entry.surface);
+        entry.users = use ? 1 : 0;
+        entries.Add(key, entry);
+        statistics.entries++;
+        statistics.bytes += entry.bytes;
+    }
+    return true;
+}
+
+void WGacDecodedImageCache::Release(vuint64_t key)
+{
+    cairo_surface_t* surface = nullptr;
+    SPIN_LOCK(lock)
+    {
+        vint index = entries.Keys().IndexOf(key);
+        if (index != -1) {
+            Entry entry = entries.Values()[index];
+            if (--entry.users > 0) {
+                entries.Set(key, entry);
+            } else {
+                entries.Remove(key);
+                statistics.entries--;
+                statistics.bytes -= entry.bytes;
+                surface = entry.surface;
+            }
+        }
+    }
+    if (surface) {
+        cairo_surface_destroy(surface);
+    }
+}
+
+bool WGacDecodedImageCache::BeginPending(vuint64_t key)
+{
+    SPIN_LOCK(lock)
+    {
+        if (entries.Keys().Contains(key) || pending.Keys().Contains(key)) {
+            return false;
+        }
+        auto event = Ptr(new EventObject);
+        event->CreateManualUnsignal(false);
+        pending.Add(key, event);
+    }
+    return true;
+}
+
+void WGacDecodedImageCache::EndPending(vuint64_t key)
+{
+    Ptr<EventObject> event;
+    SPIN_LOCK(lock)
+    {
+        vint index = pending.Keys().IndexOf(key);
+        if (index != -1) {
+            event = pending.Values()[index];
+            pending.Remove(key);
+        }
+    }
+    if (event) {
+        event->Signal();
+    }
+}
+
+void WGacDecodedImageCache::WaitPending(vuint64_t key)
+{
+    Ptr<EventObject> event;
+    SPIN_LOCK(lock)
+    {
+        vint index = pending.Keys().IndexOf(key);
+        if (index != -1) {
+            event = pending.Values()[index];
+        }
+    }
+    if (event) {
+        event->Wait();
+    }
+}
+
+bool WGacDecodedImageCache::Reserve(vuint64_t key, Ptr<WGacEncodedImage>& encoded)
+{
+    SPIN_LOCK(lock)
+    {
+        vint index = entries.Keys().IndexOf(key);
+        if (index != -1) {
+            Entry entry = entries.Values()[index];
+            entry.users++;
+            entries.Set(key, entry);
+            encoded = entry.encoded;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WGacDecodedImageCache::ReleaseUnused()
+{
+    collections::List<cairo_surface_t*> unused;
+    SPIN_LOCK(lock)
+    {
+        for (vint i = entries.Count() - 1; i >= 0; i--) {
+            Entry entry = entries.Values()[i];
+            if (entry.users == 0) {
+                unused.Add(entry.surface);
+                entries.Remove(entries.Keys()[i]);
+                statistics.entries--;
+                statistics.bytes -= entry.bytes;
+            }
+        }
+    }
+    for (vint i = 0; i < unused.Count(); i++) {
+        cairo_surface_destroy(unused[i]);
+    }
+}
+
+WGacDecodedImageCache::Statistics WGacDecodedImageCache::GetStatistics()
+{
+    SPIN_LOCK(lock)
+    {
+        return statistics;
+    }
+    return Statistics();
+}
+
+// Files are keyed by path, size and modification time, so a hit does not touch the content
+static bool file_cache_key(const WString& path, vuint64_t& key)
+{
+    AString apath = wtoa(path);
+    struct stat st;
+    if (stat(apath.Buffer(), &st) != 0) return false;
+
+    vuint64_t seed = hash_mix((vuint64_t)st.st_size ^ 0x8ebc6af09c88c6e3ULL, (vuint64_t)st.st_mtim.tv_sec ^ 0x589965cc75374cc3ULL);
+    seed = hash_mix(seed ^ (vuint64_t)st.st_mtim.tv_nsec, 0x1d8e4e27c47d124fULL);
+    key = WGacDecodedImageCache::HashBytes(apath.Buffer(), apath.Length(), seed);
+    return true;
+}
+
+// WGacImageDiskCache implementation
+namespace {
+    // Native endian, so a file written on a machine with another byte order fails the magic check
+    const vuint32_t diskCacheMagic = 0x43494757;    // "WGIC"
+
+    // 64 bytes, which keeps the pixels that follow aligned for cairo
+    struct DiskCacheHeader
+    {
+        vuint32_t magic;
+        vuint32_t version;
+        vuint64_t key;
+        vint32_t format;
+        vint32_t width;
+        vint32_t height;
+        vint32_t stride;
+        vuint32_t maskColor;
+        vuint32_t reserved[7];
+    };
+    static_assert(sizeof(DiskCacheHeader) == 64, "DiskCacheHeader must stay 64 bytes");
+
+    struct DiskCacheMapping
+    {
+        void* address;
+        size_t length;
+    };
+
+    cairo_user_data_key_t diskCacheMappingKey;
+
+    void unmap_disk_cache(void* data)
+    {
+        auto mapping = static_cast<DiskCacheMapping*>(data);
+        munmap(mapping->address, mapping->length);
+        delete mapping;
+    }
+
+    bool is_disk_cache_file(const char* name)
+    {
+        size_t length = strlen(name);
+        return length > 4 && strcmp(name + length - 4, ".wgi") == 0;
+    }
+
+    bool write_all(int fd, const void* data, size_t length)
+    {
+        auto bytes = static_cast<const char*>(data);
+        while (length > 0) {
+            ssize_t written = write(fd, bytes, length);
+            if (written <= 0) return false;
+            bytes += written;
+            length -= written;
+        }
+        return true;
+    }
+}
+
+WGacImageDiskCache::WGacImageDiskCache(const AString& _directory, vint _maxBytes)
+    : directory(_directory)
+    , maxBytes(_maxBytes)
+{
+    // Create every missing parent, mkdir fails harmlessly on the ones that exist
+    for (vint i = 1; i <= directory.Length(); i++) {
+        if (i == directory.Length() || directory[i] == '/') {
+            mkdir(directory.Left(i).Buffer(), 0700);
+        }
+    }
+}
+
+AString WGacImageDiskCache::GetDefaultDirectory()
+{
+    if (const char* cacheHome = getenv("XDG_CACHE_HOME"); cacheHome && *cacheHome) {
+        return AString(cacheHome) + AString("/wgac");
+    }
+    if (const char* home = getenv("HOME"); home && *home) {
+        return AString(home) + AString("/.cache/wgac");
+    }
+    return AString::Empty;
+}
+
+AString WGacImageDiskCache::GetPath(vuint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.wgi", (unsigned long long)key);
+    return directory + AString(name);
+}
+
+cairo_surface_t* WGacImageDiskCache::Load(vuint64_t key)
+{
+    AString path = GetPath(key);
+    int fd = open(path.Buffer(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    DiskCacheHeader header;
+    bool valid = fstat(fd, &st) == 0
+        && st.st_size >= (off_t)sizeof(header)
+        && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+        && header.magic == diskCacheMagic
+        && header.version == FormatVersion
+        && header.key == key
+        && (header.format == CAIRO_FORMAT_ARGB32 || header.format == CAIRO_FORMAT_RGB24 || header.format == CAIRO_FORMAT_A8)
+        && header.width > 0 && header.height > 0
+        && header.stride == cairo_format_stride_for_width((cairo_format_t)header.format, header.width)
+        && st.st_size == (off_t)sizeof(header) + (off_t)header.stride * header.height;
+
+    if (!valid) {
+        close(fd);
+        // Stale version or a torn write
+        unlink(path.Buffer());
+        return nullptr;
+    }
+
+    // Private and writable, so a stray write to the surface never reaches the file
+    void* address = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // Recently used files survive trimming, which goes by modification time
+    futimens(fd, nullptr);
+    close(fd);
+    if (address == MAP_FAILED) return nullptr;
+
+    auto data = static_cast<unsigned char*>(address) + sizeof(header);
+    cairo_surface_t* surface = cairo_image_surface_create_for_data(data, (cairo_format_t)header.format, header.width, header.height, header.stride);
+    auto mapping = new DiskCacheMapping{ address, (size_t)st.st_size };
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_set_user_data(surface, &diskCacheMappingKey, mapping, &unmap_disk_cache) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        unmap_disk_cache(mapping);
+        return nullptr;
+    }
+
+    if (header.format == CAIRO_FORMAT_A8) {
+        SetImageMaskColor(surface, Color((unsigned char)(header.maskColor >> 16), (unsigned char)(header.maskColor >> 8), (unsigned char)header.maskColor));
+    }
+    return surface;
+}
+
+void WGacImageDiskCache::Store(vuint64_t key, cairo_surface_t* surface)
+{
+    if (!surface || directory.Length() == 0) return;
+    cairo_surface_flush(surface);
+
+    DiskCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = diskCacheMagic;
+    header.version = FormatVersion;
+    header.key = key;
+    header.format = cairo_image_surface_get_format(surface);
+    header.width = cairo_image_surface_get_width(surface);
+    header.height = cairo_image_surface_get_height(surface);
+    // Rows are written without the padding of the surface, a packed image shares the wide stride of its atlas page
+    header.stride = cairo_format_stride_for_width((cairo_format_t)header.format, header.width);
+    if (header.format == CAIRO_FORMAT_A8) {
+        Color color;
+        GetImageMaskColor(surface, color);
+        header.maskColor = ((vuint32_t)color.r << 16) | ((vuint32_t)color.g << 8) | color.b;
+    }
+    vint bytes = (vint)sizeof(header) + (vint)header.stride * header.height;
+    if (bytes > maxBytes) return;
+
+    // Written under a temporary name and renamed, so readers never see a partial file
+    AString path = GetPath(key);
+    static std::atomic<vuint32_t> storeCounter{ 0 };
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), (unsigned)storeCounter++);
+    AString temporary = path + AString(suffix);
+    int fd = open(temporary.Buffer(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    bool written = write_all(fd, &header, sizeof(header));
+    const unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    for (vint32_t y = 0; written && y < header.height; y++) {
+        written = write_all(fd, data + y * stride, header.stride);
+    }
+    close(fd);
+    if (!written || rename(temporary.Buffer(), path.Buffer()) != 0) {
+        unlink(temporary.Buffer());
+        return;
+    }
+
+    SPIN_LOCK(lock)
+    {
+        if (totalBytes == -1) {
+            totalBytes = ScanLocked();
+        } else {
+            totalBytes += bytes;
+        }
+        if (totalBytes > maxBytes) {
+            // Trim with some headroom so that the next few stores do not scan again
+            TrimLocked(maxBytes - maxBytes / 4);
+        }
+    }
+}
+
+vint WGacImageDiskCache::ScanLocked()
+{
+    vint total = 0;
+    if (DIR* dir = opendir(directory.Buffer())) {
+        while (auto entry = readdir(dir)) {
+            struct stat st;
+            if (is_disk_cache_file(entry->d_name) && stat((directory + AString("/") + AString(entry->d_name)).Buffer(), &st) == 0) {
+                total += st.st_size;
+            }
+        }
+        closedir(dir);
+    }
+    return total;
+}
+
+void WGacImageDiskCache::TrimLocked(vint targetBytes)
+{
+    struct CacheFile
+    {
+        AString path;
+        vint size;
+        timespec modified;
+    };
+    std::vector<CacheFile> files;
+    vint total = 0;
+    if (DIR* dir = opendir(directory.Buffer())) {
+        while (auto entry = readdir(dir)) {
+            struct stat st;
+            AString path = directory + AString("/") + AString(entry->d_name);
+            if (is_disk_cache_file(entry->d_name) && stat(path.Buffer(), &st) == 0) {
+                files.push_back({ path, (vint)st.st_size, st.st_mtim });
+                total += st.st_size;
+            }
+        }
+        closedir(dir);
+    }
+
+    std::sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b)
+    {
+        return a.modified.tv_sec != b.modified.tv_sec ? a.modified.tv_sec < b.modified.tv_sec : a.modified.tv_nsec < b.modified.tv_nsec;
+    });
+    for (auto& file : files) {
+        if (total <= targetBytes) break;
+        // Surfaces still mapped from the file stay valid after unlink
+        if (unlink(file.path.Buffer()) == 0) {
+            total -= file.size;
+        }
+    }
+    totalBytes = total;
+}
+
+void WGacImageDiskCache::Clear()
+{
+    SPIN_LOCK(lock)
+    {
+        TrimLocked(0);
+    }
+}
+
+// Skip a chain of GIF data sub-blocks, returns false if the data ends before the terminator
+static bool skip_gif_sub_blocks(const unsigned char* data, vint length, vint& pos)
+{
+    while (pos < length) {
+        vint size = data[pos++];
+        if (size == 0) return true;
+        pos += size;
+    }
+    return false;
+}
+
+// Walk the GIF block structure to count frames and read their delays without decoding any pixels
+// restoresPrevious is set if a frame is disposed by restoring what was there before it
+static bool scan_gif(const unsigned char* data, vint length, Size& size, collections::List<vint>& delays, bool* restoresPrevious = nullptr)
+{
+    if (detect_format(data, length) != INativeImage::Gif || length < 13) return false;
+    size = Size(data[6] | (data[7] << 8), data[8] | (data[9] << 8));
+    vint flags = data[10];
+    vint pos = 13;
+    if (flags & 0x80) pos += 3 * (2 << (flags & 7));
+
+    vint delay = 0;
+    while (pos < length) {
+        vint tag = data[pos];
+        if (tag == 0x21) {
+            if (pos + 2 > length) break;
+            vint label = data[pos + 1];
+            pos += 2;
+            // Graphic Control Extension, the delay is in 1/100 s and applies to the next image only
+            if (label == 0xF9 && pos + 5 <= length && data[pos] == 4) {
+                delay = (data[pos + 2] | (data[pos + 3] << 8)) * 10;
+                if (restoresPrevious && ((data[pos + 1] >> 2) & 7) == 3) {
+                    *restoresPrevious = true;
+                }
+            }
+            if (!skip_gif_sub_blocks(data, length, pos)) break;
+        } else if (tag == 0x2C) {
+            if (pos + 10 > length) break;
+            vint localFlags = data[pos + 9];
+            pos += 10;
+            if (localFlags & 0x80) pos += 3 * (2 << (localFlags & 7));
+            // LZW minimum code size
+            pos++;
+            if (!skip_gif_sub_blocks(data, length, pos)) break;
+            delays.Add(delay);
+            delay = 0;
+        } else {
+            break;
+        }
+    }
+    return size.x > 0 && size.y > 0 && delays.Count() > 0;
+}
+
+// Sequential GIF frame decoder built on stb's internal loader,
+// frames compose on top of each other so reaching an earlier frame means starting over
+class WGacGifDecoder : public Object
+{
+protected:
+    Ptr<WGacEncodedImage> encoded;
+    stbi__context context;
+    stbi__gif gif;
+    vint nextFrame = 0;
+    // The two frames composed last, oldest first. Restoring to the previous picture needs the one
+    // two frames back, without it stb clears to the background instead.
+    stbi_uc* composed[2] = { nullptr, nullptr };
+
+    void FreeBuffers()
+    {
+        STBI_FREE(gif.out);
+        STBI_FREE(gif.background);
+        STBI_FREE(gif.history);
+    }
+
+    void KeepComposed(const stbi_uc* pixels)
+    {
+        size_t bytes = (size_t)gif.w * gif.h * 4;
+        if (!composed[0]) {
+            composed[0] = (stbi_uc*)STBI_MALLOC(bytes);
+            composed[1] = (stbi_uc*)STBI_MALLOC(bytes);
+            if (!composed[0] || !composed[1]) {
+                // Out of memory, fall back to clearing like stb does on its own
+                STBI_FREE(composed[0]);
+                STBI_FREE(composed[1]);
+                composed[0] = composed[1] = nullptr;
+                restoresPrevious = false;
+                return;
+            }
+        }
+        stbi_uc* oldest = composed[0];
+        composed[0] = composed[1];
+        composed[1] = oldest;
+        memcpy(composed[1], pixels, bytes);
+    }
+
+public:
+    Size size;
+    collections::List<vint> delays;
+    // Frames at or after this index failed to decode
+    vint decodableFrames = 0;
+    // Set when a frame is disposed by restoring the previous picture
+    bool restoresPrevious = false;
+
+    WGacGifDecoder(Ptr<WGacEncodedImage> _encoded)
+        : encoded(_encoded)
+    {
+        memset(&gif, 0, sizeof(gif));
+        stbi__start_mem(&context, encoded->GetData(), static_cast<int>(encoded->GetLength()));
+    }
+
+    ~WGacGifDecoder()
+    {
+        FreeBuffers();
+        STBI_FREE(composed[0]);
+        STBI_FREE(composed[1]);
+    }
+
+    vint GetNextFrame() { return nextFrame; }
+    // Memory kept besides the decoded frames, counted against the frame budget
+    vint GetComposedBytes() { return restoresPrevious ? size.x * size.y * 4 * 2 : 0; }
+
+    void Restart()
+    {
+        FreeBuffers();
+        memset(&gif, 0, sizeof(gif));
+        stbi__start_mem(&context, encoded->GetData(), static_cast<int>(encoded->GetLength()));
+        nextFrame = 0;
+    }
+
+    // Composes the next frame, and copies it into a new surface if requested
+    bool DecodeNext(bool createSurface, cairo_surface_t*& surface)
+    {
+        surface = nullptr;
+        int comp = 0;
+        stbi_uc* twoBack = restoresPrevious && nextFrame >= 2 ? composed[0] : nullptr;
+        stbi_uc* pixels = stbi__gif_load_next(&context, &gif, &comp, 4, twoBack);
+        if (!pixels || pixels == (stbi_uc*)&context) {
+            decodableFrames = nextFrame;
+            return false;
+        }
+        nextFrame++;
+        if (restoresPrevious) {
+            KeepComposed(pixels);
+        }
+
+        if (createSurface) {
+            surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, gif.w, gif.h);
+            if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+                cairo_surface_destroy(surface);
+                surface = nullptr;
+                return false;
+            }
+            copy_rgba_to_surface(pixels, gif.w, gif.h, surface);
+        }
+        return true;
+    }
+};
+
+// WGacImageFrame implementation
+WGacImageFrame::WGacImageFrame(INativeImage* _image, cairo_surface_t* _surface)
+    : image(_image)
+    , surface(_surface)
+{
+    if (surface) {
+        size = Size(
+            cairo_image_surface_get_width(surface),
+            cairo_image_surface_get_height(surface)
+        );
+    }
+}
+
+WGacImageFrame::WGacImageFrame(INativeImage* _image, Size _size, vint _index)
+    : surface(nullptr)
+    , image(_image)
+    , size(_size)
+    , index(_index)
+{
+}
+
+cairo_surface_t* WGacImageFrame::GetSurface()
+{
+    if (auto wgacImage = dynamic_cast<WGacImage*>(image)) {
+        if (surface) {
+            wgacImage->TouchDecodedSurface();
+        } else {
+            wgacImage->DecodeFrame(index);
+        }
+    }
+    return surface;
+}
+
+bool WGacImageFrame::GetAtlasRegion(cairo_surface_t*& page, Rect& region)
+{
+    return surface && WGacImageAtlas::GetRegion(surface, page, region);
+}
+
+void WGacImageFrame::SetSurface(cairo_surface_t* _surface)
+{
+    if (surface) {
+        cairo_surface_destroy(surface);
+    }
+    surface = _surface;
+    if (surface) {
+        size = Size(
+            cairo_image_surface_get_width(surface),
+            cairo_image_surface_get_height(surface)
+        );
+    }
+}
+
+WGacImageFrame::~WGacImageFrame()
+{
+    for (vint i = 0; i < caches.Count(); i++) {
+        caches.Values()[i]->OnDetach(this);
+    }
+    caches.Clear();
+    if (surface) {
+        cairo_surface_destroy(surface);
+    }
+}
+
+INativeImage* WGacImageFrame::GetImage()
+{
+    return image;
+}
+
+Size WGacImageFrame::GetSize()
+{
+    return size;
+}
+
+bool WGacImageFrame::SetCache(void* key, Ptr<INativeImageFrameCache> cache)
+{
+    if (caches.Keys().Contains(key)) {
+        return false;
+    }
+    caches.Add(key, cache);
+    cache->OnAttach(this);
+    return true;
+}
+
+Ptr<INativeImageFrameCache> WGacImageFrame::GetCache(void* key)
+{
+    vint index = caches.Keys().IndexOf(key);
+    if (index != -1) {
+        return caches.Values()[index];
+    }
+    return nullptr;
+}
+
+Ptr<INativeImageFrameCache> WGacImageFrame::RemoveCache(void* key)
+{
+    vint index = caches.Keys().IndexOf(key);
+    if (index != -1) {
+        Ptr<INativeImageFrameCache> cache = caches.Values()[index];
+        caches.Remove(key);
+        cache->OnDetach(this);
+        return cache;
+    }
+    return nullptr;
+}
+
+// Resample a surface to an exact pixel size
+static cairo_surface_t* resample_surface(cairo_surface_t* source, int srcWidth, int srcHeight, int width, int height, cairo_filter_t filter)
+{
+    cairo_surface_t* result = cairo_image_surface_create(cairo_image_surface_get_format(source), width, height);
+    if (cairo_surface_status(result) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(result);
+        return nullptr;
+    }
+
+    cairo_t* cr = cairo_create(result);
+    cairo_scale(cr, (double)width / srcWidth, (double)height / srcHeight);
+    cairo_set_source_surface(cr, source, 0, 0);
+    // PAD keeps the edges from fading into the transparent outside of the source
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    cairo_pattern_set_filter(cairo_get_source(cr), filter);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    // A mask is only painted in the right colour if the copy carries it too
+    Color color;
+    if (GetImageMaskColor(source, color)) {
+        SetImageMaskColor(result, color);
+    }
+    return result;
+}
+
+// Build a high quality resampled copy, halving first (mipmap style) for large reductions
+static cairo_surface_t* create_scaled_surface(cairo_surface_t* source, int width, int height)
+{
+    int srcWidth = cairo_image_surface_get_width(source);
+    int srcHeight = cairo_image_surface_get_height(source);
+
+    cairo_surface_t* current = cairo_surface_reference(source);
+    while (srcWidth >= width * 2 && srcHeight >= height * 2) {
+        // Bilinear sampling at exactly half size averages each 2x2 block
+        int halfWidth = srcWidth / 2;
+        int halfHeight = srcHeight / 2;
+        cairo_surface_t* half = resample_surface(current, srcWidth, srcHeight, halfWidth, halfHeight, CAIRO_FILTER_BILINEAR);
+        cairo_surface_destroy(current);
+        if (!half) return nullptr;
+        current = half;
+        srcWidth = halfWidth;
+        srcHeight = halfHeight;
+    }
+
+    cairo_surface_t* result = nullptr;
+    if (srcWidth == width && srcHeight == height) {
+        result = cairo_surface_reference(current);
+    } else {
+        result = resample_surface(current, srcWidth, srcHeight, width, height, CAIRO_FILTER_GOOD);
+    }
+    cairo_surface_destroy(current);
+    return result;
+}
+
+// WGacImageFrameVariants implementation
+namespace {
+    char imageFrameVariantsKey;
+}
+
+WGacImageFrameVariants::~WGacImageFrameVariants()
+{
+    Clear();
+}
+
+void WGacImageFrameVariants::OnAttach(INativeImageFrame* _frame)
+{
+    frame = dynamic_cast<WGacImageFrame*>(_frame);
+}
+
+void WGacImageFrameVariants::OnDetach(INativeImageFrame* _frame)
+{
+    Clear();
+    frame = nullptr;
+}
+
+void WGacImageFrameVariants::Clear()
+{
+    for (vint i = 0; i < variants.Count(); i++) {
+        cairo_surface_destroy(variants[i].surface);
+    }
+    variants.Clear();
+    totalBytes = 0;
+}
+
+void WGacImageFrameVariants::EvictFor(vint requiredBytes)
+{
+    while (variants.Count() > 0 && totalBytes + requiredBytes > MaxBytesPerFrame) {
+        vint oldest = 0;
+        for (vint i = 1; i < variants.Count(); i++) {
+            if (variants[i].lastUsed < variants[oldest].lastUsed) {
+                oldest = i;
+            }
+        }
+        Variant& variant = variants[oldest];
+        totalBytes -= cairo_image_surface_get_stride(variant.surface) * variant.deviceSize.y;
+        cairo_surface_destroy(variant.surface);
+        variants.RemoveAt(oldest);
+    }
+}
+
+cairo_surface_t* WGacImageFrameVariants::Find(Size deviceSize, bool disabled)
+{
+    for (vint i = 0; i < variants.Count(); i++) {
+        if (variants[i].deviceSize == deviceSize && variants[i].disabled == disabled) {
+            variants[i].lastUsed = ++useCounter;
+            return variants[i].surface;
+        }
+    }
+    return nullptr;
+}
+
+cairo_surface_t* WGacImageFrameVariants::Store(Size deviceSize, bool disabled, cairo_surface_t* surface)
+{
+    vint bytes = cairo_image_surface_get_stride(surface) * deviceSize.y;
+    EvictFor(bytes);
+    Variant variant;
+    variant.deviceSize = deviceSize;
+    variant.disabled = disabled;
+    variant.surface = surface;
+    variant.lastUsed = ++useCounter;
+    variants.Add(variant);
+    totalBytes += bytes;
+    return surface;
+}
+
+cairo_surface_t* WGacImageFrameVariants::GetVariant(Size deviceSize, bool disabled)
+{
+    if (!frame || !frame->GetSurface()) return nullptr;
+    if (deviceSize.x <= 0 || deviceSize.y <= 0) return nullptr;
+
+    // A mask looks disabled by the colour it is painted with, see PaintImageSurface
+    cairo_format_t format = cairo_image_surface_get_format(frame->GetSurface());
+    if (format == CAIRO_FORMAT_A8) {
+        disabled = false;
+    }
+
+    Size frameSize = frame->GetSize();
+    if (deviceSize == frameSize && !disabled) {
+        return frame->GetSurface();
+    }
+    if (auto surface = Find(deviceSize, disabled)) {
+        return surface;
+    }
+
+    vint bytes = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, deviceSize.x) * deviceSize.y;
+    if (bytes > MaxBytesPerFrame) return nullptr;
+
+    cairo_surface_t* surface = nullptr;
+    if (disabled) {
+        // Scaled disabled variants are resampled from the full size disabled one
+        cairo_surface_t* source = nullptr;
+        if (deviceSize == frameSize) {
+            source = frame->GetSurface();
+        } else {
+            source = GetVariant(frameSize, true);
+            if (!source) return nullptr;
+            // Keep the full size disabled variant alive while resampling from it
+            cairo_surface_reference(source);
+        }
+
+        if (deviceSize == frameSize) {
+            surface = cairo_image_surface_create(format, frameSize.x, frameSize.y);
+            if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+                cairo_surface_destroy(surface);
+                return nullptr;
+            }
+            cairo_surface_flush(source);
+            unsigned char* src = cairo_image_surface_get_data(source);
+            unsigned char* dst = cairo_image_surface_get_data(surface);
+            int srcStride = cairo_image_surface_get_stride(source);
+            int dstStride = cairo_image_surface_get_stride(surface);
+            for (vint y = 0; y < frameSize.y; y++) {
+                DisablePixels((const uint32_t*)(src + y * srcStride), (uint32_t*)(dst + y * dstStride), frameSize.x);
+            }
+            cairo_surface_mark_dirty(surface);
+        } else {
+            surface = create_scaled_surface(source, deviceSize.x, deviceSize.y);
+            cairo_surface_destroy(source);
+        }
+    } else {
+        surface = create_scaled_surface(frame->GetSurface(), deviceSize.x, deviceSize.y);
+    }
+    if (!surface) return nullptr;
+
+    return Store(deviceSize, disabled, surface);
+}
+
+WGacImageFrameVariants* WGacImageFrameVariants::GetOrCreate(WGacImageFrame* frame)
+{
+    auto cache = frame->GetCache(&imageFrameVariantsKey);
+    if (!cache) {
+        cache = Ptr(new WGacImageFrameVariants);
+        frame->SetCache(&imageFrameVariantsKey, cache);
+    }
+    return dynamic_cast<WGacImageFrameVariants*>(cache.Obj());
+}
+
+// WGacImageMemoryBudget implementation
+WGacImageMemoryBudget::WGacImageMemoryBudget()
+    : budget(DefaultBudget)
+{
+}
+
+void WGacImageMemoryBudget::Link(Charge* charge)
+{
+    charge->prev = nullptr;
+    charge->next = mostRecent;
+    if (mostRecent) {
+        mostRecent->prev = charge;
+    } else {
+        leastRecent = charge;
+    }
+    mostRecent = charge;
+}
+
+void WGacImageMemoryBudget::Unlink(Charge* charge)
+{
+    if (charge->prev) {
+        charge->prev->next = charge->next;
+    } else {
+        mostRecent = charge->next;
+    }
+    if (charge->next) {
+        charge->next->prev = charge->prev;
+    } else {
+        leastRecent = charge->prev;
+    }
+    charge->prev = nullptr;
+    charge->next = nullptr;
+}
+
+void WGacImageMemoryBudget::EvictLocked(vint targetBytes, Charge* keep)
+{
+    while (usedBytes > targetBytes) {
+        Charge* victim = leastRecent == keep && keep ? keep->prev : leastRecent;
+        if (!victim) break;
+        // Dropping the pixels may destroy the surface, the charge is forgotten first
+        auto charge = charges[victim->surface];
+        Unlink(victim);
+        charges.Remove(victim->surface);
+        usedBytes -= victim->bytes;
+        for (vint i = 0; i < charge->images.Count(); i++) {
+            charge->images[i]->budgetSurface = nullptr;
+            charge->images[i]->DropDecodedSurface();
+        }
+    }
+}
+
+void WGacImageMemoryBudget::Add(WGacImage* image, cairo_surface_t* surface)
+{
+    SPIN_LOCK(lock)
+    {
+        if (!image->budgetSurface) {
+            Ptr<Charge> charge;
+            vint index = charges.Keys().IndexOf(surface);
+            if (index == -1) {
+                charge = Ptr(new Charge);
+                charge->surface = surface;
+                charge->bytes = surface_bytes(surface);
+                charges.Add(surface, charge);
+                usedBytes += charge->bytes;
+            } else {
+                charge = charges.Values()[index];
+                Unlink(charge.Obj());
+            }
+            Link(charge.Obj());
+            charge->images.Add(image);
+            image->budgetSurface = surface;
+            EvictLocked(budget, charge.Obj());
+        }
+    }
+}
+
+void WGacImageMemoryBudget::Remove(WGacImage* image)
+{
+    SPIN_LOCK(lock)
+    {
+        if (image->budgetSurface) {
+            auto charge = charges[image->budgetSurface];
+            image->budgetSurface = nullptr;
+            charge->images.Remove(image);
+            if (charge->images.Count() == 0) {
+                usedBytes -= charge->bytes;
+                Unlink(charge.Obj());
+                charges.Remove(charge->surface);
+            }
+        }
+    }
+}
+
+void WGacImageMemoryBudget::Touch(WGacImage* image)
+{
+    SPIN_LOCK(lock)
+    {
+        if (image->budgetSurface) {
+            Charge* charge = charges[image->budgetSurface].Obj();
+            if (mostRecent != charge) {
+                Unlink(charge);
+                Link(charge);
+            }
+        }
+    }
+}
+
+vint WGacImageMemoryBudget::GetBudget()
+{
+    SPIN_LOCK(lock)
+    {
+        return budget;
+    }
+    return 0;
+}
+
+void WGacImageMemoryBudget::SetBudget(vint bytes)
+{
+    SPIN_LOCK(lock)
+    {
+        budget = bytes;
+        EvictLocked(budget, nullptr);
+    }
+}
+
+vint WGacImageMemoryBudget::GetUsedBytes()
+{
+    SPIN_LOCK(lock)
+    {
+        return usedBytes;
+    }
+    return 0;
+}
+
+void WGacImageMemoryBudget::Trim(vint targetBytes)
+{
+    SPIN_LOCK(lock)
+    {
+        EvictLocked(targetBytes, nullptr);
+    }
+}
+
+// WGacImage implementation
+WGacImage::WGacImage(INativeImageService* service, cairo_surface_t* surface)
+    : imageService(service)
+    , formatType(INativeImage::Png)
+    , frameBudget(DefaultFrameBudget)
+    , decoded(true)
+    , pendingSurface(nullptr)
+{
+    decodedEvent.CreateManualUnsignal(true);
+    if (surface) {
+        frames.Resize(1);
+        frames[0] = Ptr(new WGacImageFrame(this, surface));
+    }
+}
+
+WGacImage::WGacImage(INativeImageService* service, Size size)
+    : imageService(service)
+    , formatType(INativeImage::Png)
+    , frameBudget(DefaultFrameBudget)
+    , decoded(false)
+    , pendingSurface(nullptr)
+{
+    decodedEvent.CreateManualUnsignal(false);
+    frames.Resize(1);
+    frames[0] = Ptr(new WGacImageFrame(this, size));
+}
+
+WGacImage::WGacImage(INativeImageService* service, Ptr<WGacGifDecoder> decoder)
+    : imageService(service)
+    , formatType(INativeImage::Gif)
+    , gifDecoder(decoder)
+    , frameBudget(DefaultFrameBudget)
+    , decoded(true)
+    , pendingSurface(nullptr)
+{
+    decodedEvent.CreateManualUnsignal(true);
+    vint count = gifDecoder->delays.Count();
+    gifDecoder->decodableFrames = count;
+    frames.Resize(count);
+    frameDelays.Resize(count);
+    for (vint i = 0; i < count; i++) {
+        frames[i] = Ptr(new WGacImageFrame(this, gifDecoder->size, i));
+        frameDelays[i] = gifDecoder->delays[i];
+    }
+}
+
+WGacImage::~WGacImage()
+{
+    if (budget) {
+        budget->Remove(this);
+    }
+    if (self) {
+        self->image = nullptr;
+    }
+    if (pendingSurface) {
+        cairo_surface_destroy(pendingSurface);
+    }
+    if (pendingCache) {
+        pendingCache->Release(pendingCacheKey);
+    }
+    frames.Resize(0);
+    ReleaseCacheEntry();
+}
+
+void WGacImage::SetRedecodeSource(Ptr<WGacEncodedImage> _encoded, Ptr<WGacImageMemoryBudget> _budget, Size maxSize)
+{
+    if (gifDecoder || frames.Count() != 1) return;
+    encoded = _encoded;
+    decodeMaxSize = maxSize;
+    budget = _budget;
+    self = Ptr(new AliveToken);
+    self->image = this;
+    TrackDecodedSurface();
+}
+
+void WGacImage::TrackDecodedSurface()
+{
+    if (!budget || frames.Count() == 0 || !frames[0]->IsSurfaceLoaded()) return;
+    budget->Add(this, frames[0]->GetSurface());
+}
+
+void WGacImage::TouchDecodedSurface()
+{
+    if (budget) {
+        budget->Touch(this);
+    }
+}
+
+void WGacImage::DropDecodedSurface()
+{
+    WGacImageFrame* frame = frames[0].Obj();
+    if (auto variants = frame->GetCache(&imageFrameVariantsKey)) {
+        dynamic_cast<WGacImageFrameVariants*>(variants.Obj())->Clear();
+    }
+    frame->SetSurface(nullptr);
+    ReleaseCacheEntry();
+}
+
+void WGacImage::InstallRedecodedSurface(cairo_surface_t* surface)
+{
+    SPIN_LOCK(decodingLock)
+    {
+        redecoding = false;
+        if (!surface) {
+            decodeFailed = true;
+        }
+    }
+    if (surface && frames[0]->IsSurfaceLoaded()) {
+        cairo_surface_destroy(surface);
+    } else if (surface) {
+        if (cache && !cacheUser) {
+            WGacDecodedImageCache::Entry entry;
+            entry.surface = surface;
+            entry.format = formatType;
+            entry.encoded = encoded;
+            cacheUser = cache->Insert(cacheKey, entry);
+        }
+        frames[0]->SetSurface(surface);
+        TrackDecodedSurface();
+    }
+    RunDecodedCallbacks();
+}
+
+void WGacImage::RestoreDecodedSurface(bool async)
+{
+    if (!encoded || frames.Count() != 1 || frames[0]->IsSurfaceLoaded()) return;
+    SPIN_LOCK(decodingLock)
+    {
+        // A valid header with a corrupt body fails the same way every time
+        if (decodeFailed) return;
+    }
+
+    // Another image may still be using the same pixels
+    if (cache) {
+        WGacDecodedImageCache::Entry entry;
+        if (cache->Lookup(cacheKey, entry)) {
+            cacheUser = true;
+            InstallRedecodedSurface(entry.surface);
+            return;
+        }
+    }
+
+    auto controller = GetCurrentController();
+    if (!async || !controller) {
+        InstallRedecodedSurface(pack_surface(decode_to_surface_at_size(encoded->GetData(), encoded->GetLength(), decodeMaxSize)));
+        return;
+    }
+    SPIN_LOCK(decodingLock)
+    {
+        if (redecoding) return;
+        redecoding = true;
+    }
+
+    auto source = encoded;
+    auto maxSize = decodeMaxSize;
+    auto alive = self;
+    INativeAsyncService* asyncService = controller->AsyncService();
+    asyncService->InvokeAsync([=]()
+    {
+        cairo_surface_t* surface = decode_to_surface_at_size(source->GetData(), source->GetLength(), maxSize);
+        asyncService->InvokeInMainThread(nullptr, [=]()
+        {
+            if (alive->image) {
+                alive->image->InstallRedecodedSurface(pack_surface(surface));
+            } else if (surface) {
+                cairo_surface_destroy(surface);
+            }
+        });
+    });
+}
+
+void WGacImage::SetFormat(FormatType format)
+{
+    formatType = format;
+}
 
-        for (int x = 0; x < width; x++) {
-            unsigned char r = src_row[x * 4 + 0];
-            unsigned char g = src_row[x * 4 + 1];
-            unsigned char b = src_row[x * 4 + 2];
-            unsigned char a = src_row[x * 4 + 3];
+vint WGacImage::GetFrameDelay(vint index)
+{
+    if (index < 0 || index >= frameDelays.Count()) return 0;
+    // Like browsers, treat the near-zero delays found in many GIFs as the common 100ms default
+    vint delay = frameDelays[index];
+    return delay <= 10 ? 100 : delay;
+}
+
+vint WGacImage::GetFrameBudget()
+{
+    return frameBudget;
+}
+
+void WGacImage::SetFrameBudget(vint bytes)
+{
+    frameBudget = bytes;
+    EvictFramesFor(-1, 0);
+}
 
-            // Cairo uses premultiplied alpha
-            r = r * a / 255;
-            g = g * a / 255;
-            b = b * a / 255;
+void WGacImage::EvictFramesFor(vint index, vint bytes)
+{
+    vint count = frames.Count();
+    vint composedBytes = gifDecoder ? gifDecoder->GetComposedBytes() : 0;
+    while (decodedFrameBytes > 0 && decodedFrameBytes + composedBytes + bytes > frameBudget) {
+        // Drop the frame that playback reaches last, counting forward from the requested one
+        vint victim = -1;
+        vint victimDistance = -1;
+        for (vint i = 0; i < count; i++) {
+            if (i == index || !frames[i]->IsSurfaceLoaded()) continue;
+            vint distance = index == -1 ? i : (i - index + count) % count;
+            if (distance > victimDistance) {
+                victim = i;
+                victimDistance = distance;
+            }
+        }
+        if (victim == -1) break;
 
-            // ARGB32 format: 0xAARRGGBB
-            dest_row[x] = (a << 24) | (r << 16) | (g << 8) | b;
+        WGacImageFrame* frame = frames[victim].Obj();
+        cairo_surface_t* surface = frame->GetSurface();
+        decodedFrameBytes -= surface_bytes(surface);
+        if (auto variants = frame->GetCache(&imageFrameVariantsKey)) {
+            dynamic_cast<WGacImageFrameVariants*>(variants.Obj())->Clear();
         }
+        frame->SetSurface(nullptr);
     }
-
-    cairo_surface_mark_dirty(surface);
 }
 
-// Helper to read file into memory
-static std::vector<unsigned char> read_file(const char* path)
+void WGacImage::DecodeFrame(vint index)
 {
-    std::vector<unsigned char> data;
-    std::ifstream file(path, std::ios::binary | std::ios::ate);
-    if (!file) return data;
+    if (!gifDecoder) {
+        // Pixels dropped by the memory budget come back in the background, OnDecoded callbacks run when they land
+        if (index == 0 && IsDecoded() && !InstallPendingSurface()) {
+            RestoreDecodedSurface(true);
+        }
+        return;
+    }
+    if (index < 0 || index >= gifDecoder->decodableFrames) return;
+    if (frames[index]->IsSurfaceLoaded()) return;
+
+    if (gifDecoder->GetNextFrame() > index) {
+        gifDecoder->Restart();
+    }
 
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    cairo_surface_t* surface = nullptr;
+    while (gifDecoder->GetNextFrame() <= index) {
+        // Earlier frames only need to be composed, not copied out
+        bool target = gifDecoder->GetNextFrame() == index;
+        if (!gifDecoder->DecodeNext(target, surface)) {
+            return;
+        }
+    }
+    if (!surface) return;
 
-    data.resize(size);
-    file.read(reinterpret_cast<char*>(data.data()), size);
-    return data;
+    vint bytes = surface_bytes(surface);
+    EvictFramesFor(index, bytes);
+    frames[index]->SetSurface(surface);
+    decodedFrameBytes += bytes;
 }
 
-// Callback for stb_image_write to write to vector
-static void stbi_write_callback(void* context, void* data, int size)
+void WGacImage::SetCacheEntry(Ptr<WGacDecodedImageCache> _cache, vuint64_t key)
 {
-    std::vector<unsigned char>* vec = static_cast<std::vector<unsigned char>*>(context);
-    unsigned char* bytes = static_cast<unsigned char*>(data);
-    vec->insert(vec->end(), bytes, bytes + size);
+    cache = _cache;
+    cacheKey = key;
+    cacheUser = true;
 }
 
-// WGacImageFrame implementation
-WGacImageFrame::WGacImageFrame(INativeImage* _image, cairo_surface_t* _surface)
-    : image(_image)
-    , surface(_surface)
+void WGacImage::ReleaseCacheEntry()
 {
-    if (surface) {
-        size = Size(
-            cairo_image_surface_get_width(surface),
-            cairo_image_surface_get_height(surface)
-        );
+    if (cacheUser) {
+        cacheUser = false;
+        cache->Release(cacheKey);
     }
 }
 
-WGacImageFrame::~WGacImageFrame()
+bool WGacImage::InstallPendingSurface()
 {
+    cairo_surface_t* surface = nullptr;
+    Ptr<WGacDecodedImageCache> reservedCache;
+    vuint64_t reservedKey = 0;
+    SPIN_LOCK(decodingLock)
+    {
+        surface = pendingSurface;
+        pendingSurface = nullptr;
+        reservedCache = pendingCache;
+        reservedKey = pendingCacheKey;
+        pendingCache = nullptr;
+    }
+    if (reservedCache) {
+        // The reservation keeps the entry alive, the lookup takes the pixels and becomes the use of this image
+        WGacDecodedImageCache::Entry entry;
+        if (reservedCache->Lookup(reservedKey, entry)) {
+            surface = entry.surface;
+            SetCacheEntry(reservedCache, reservedKey);
+        }
+        reservedCache->Release(reservedKey);
+    }
     if (surface) {
-        cairo_surface_destroy(surface);
+        frames[0]->SetSurface(pack_surface(surface));
+        TrackDecodedSurface();
+        return true;
     }
+    return false;
 }
 
-INativeImage* WGacImageFrame::GetImage()
+bool WGacImage::IsDecoded()
 {
-    return image;
+    SPIN_LOCK(decodingLock)
+    {
+        return decoded;
+    }
+    return false;
 }
 
-Size WGacImageFrame::GetSize()
+bool WGacImage::IsDecoding()
 {
-    return size;
+    SPIN_LOCK(decodingLock)
+    {
+        return !decoded || redecoding;
+    }
+    return false;
 }
 
-bool WGacImageFrame::SetCache(void* key, Ptr<INativeImageFrameCache> cache)
+void WGacImage::WaitForDecoding()
 {
-    if (caches.Keys().Contains(key)) {
-        return false;
-    }
-    caches.Add(key, cache);
-    return true;
+    decodedEvent.Wait();
+    InstallPendingSurface();
 }
 
-Ptr<INativeImageFrameCache> WGacImageFrame::GetCache(void* key)
+void WGacImage::OnDecoded(const Func<void()>& callback)
 {
-    vint index = caches.Keys().IndexOf(key);
-    if (index != -1) {
-        return caches.Values()[index];
+    bool ready = false;
+    SPIN_LOCK(decodingLock)
+    {
+        ready = decoded && !redecoding;
+        if (!ready) {
+            decodedCallbacks.Add(callback);
+        }
+    }
+    if (ready) {
+        InstallPendingSurface();
+        callback();
     }
-    return nullptr;
 }
 
-Ptr<INativeImageFrameCache> WGacImageFrame::RemoveCache(void* key)
+void WGacImage::SetDecodedSurface(cairo_surface_t* surface)
 {
-    vint index = caches.Keys().IndexOf(key);
-    if (index != -1) {
-        Ptr<INativeImageFrameCache> cache = caches.Values()[index];
-        caches.Remove(key);
-        return cache;
+    SPIN_LOCK(decodingLock)
+    {
+        pendingSurface = surface;
+        decoded = true;
+        decodeFailed = surface == nullptr;
     }
-    return nullptr;
+    decodedEvent.Signal();
 }
 
-// WGacImage implementation
-WGacImage::WGacImage(INativeImageService* service, cairo_surface_t* surface)
-    : imageService(service)
-    , formatType(INativeImage::Png)
+void WGacImage::SetDecodedFromCache(Ptr<WGacDecodedImageCache> cache, vuint64_t key)
 {
-    if (surface) {
-        frames.Resize(1);
-        frames[0] = Ptr(new WGacImageFrame(this, surface));
+    SPIN_LOCK(decodingLock)
+    {
+        pendingCache = cache;
+        pendingCacheKey = key;
+        decoded = true;
     }
+    decodedEvent.Signal();
 }
 
-WGacImage::~WGacImage()
+void WGacImage::NotifyDecoded()
+{
+    InstallPendingSurface();
+    RunDecodedCallbacks();
+}
+
+void WGacImage::RunDecodedCallbacks()
 {
+    collections::List<Func<void()>> callbacks;
+    SPIN_LOCK(decodingLock)
+    {
+        CopyFrom(callbacks, decodedCallbacks);
+        decodedCallbacks.Clear();
+    }
+    for (vint i = 0; i < callbacks.Count(); i++) {
+        callbacks[i]();
+    }
 }
 
 INativeImageService* WGacImage::GetImageService()
@@ -167,122 +2147,501 @@ INativeImageFrame* WGacImage::GetFrame(vint index)
     return nullptr;
 }
 
-void WGacImage::SaveToStream(stream::IStream& imageStream, FormatType format)
+// PNG is encoded row by row, JPEG and BMP through stb_image_write which needs the whole converted image
+static bool encode_surface(cairo_surface_t* surface, stream::IStream& imageStream, INativeImage::FormatType format, WGacPngCompression compression)
 {
-    if (frames.Count() == 0) return;
-
-    WGacImageFrame* frame = frames[0].Obj();
-    cairo_surface_t* surface = frame->GetSurface();
-    if (!surface) return;
+    if (format != INativeImage::Jpeg && format != INativeImage::Bmp) {
+        return EncodePng(surface, imageStream, compression);
+    }
 
+    cairo_surface_flush(surface);
     int width = cairo_image_surface_get_width(surface);
     int height = cairo_image_surface_get_height(surface);
     int stride = cairo_image_surface_get_stride(surface);
     unsigned char* data = cairo_image_surface_get_data(surface);
 
-    // Convert from Cairo ARGB32 (premultiplied) to RGBA
     std::vector<unsigned char> rgba(width * height * 4);
     for (int y = 0; y < height; y++) {
-        uint32_t* src_row = (uint32_t*)(data + y * stride);
-        unsigned char* dest_row = rgba.data() + y * width * 4;
-
-        for (int x = 0; x < width; x++) {
-            uint32_t pixel = src_row[x];
-            unsigned char a = (pixel >> 24) & 0xFF;
-            unsigned char r = (pixel >> 16) & 0xFF;
-            unsigned char g = (pixel >> 8) & 0xFF;
-            unsigned char b = pixel & 0xFF;
-
-            // Unpremultiply alpha
-            if (a > 0 && a < 255) {
-                r = r * 255 / a;
-                g = g * 255 / a;
-                b = b * 255 / a;
-            }
+        SurfaceRowToRgba(surface, data + y * stride, width, rgba.data() + y * width * 4);
+    }
 
-            dest_row[x * 4 + 0] = r;
-            dest_row[x * 4 + 1] = g;
-            dest_row[x * 4 + 2] = b;
-            dest_row[x * 4 + 3] = a;
-        }
+    StbStreamWriter writer(imageStream);
+    int written = format == INativeImage::Jpeg
+        ? stbi_write_jpg_to_func(stbi_write_callback, &writer, width, height, 4, rgba.data(), 90)
+        : stbi_write_bmp_to_func(stbi_write_callback, &writer, width, height, 4, rgba.data());
+    return writer.Flush() && written != 0;
+}
+
+cairo_surface_t* WGacImage::GetEncodableSurface()
+{
+    if (frames.Count() == 0) return nullptr;
+    WaitForDecoding();
+    RestoreDecodedSurface(false);
+    return frames[0]->GetSurface();
+}
+
+void WGacImage::SaveToStream(stream::IStream& imageStream, FormatType format)
+{
+    SaveToStream(imageStream, format, WGacPngCompression::Default);
+}
+
+bool WGacImage::SaveToStream(stream::IStream& imageStream, FormatType format, WGacPngCompression compression)
+{
+    cairo_surface_t* surface = GetEncodableSurface();
+    return surface && encode_surface(surface, imageStream, format, compression);
+}
+
+void WGacImage::SaveToStreamAsync(Ptr<stream::IStream> imageStream, FormatType format, WGacPngCompression compression, const Func<void(bool)>& callback)
+{
+    cairo_surface_t* surface = GetEncodableSurface();
+    auto controller = GetCurrentController();
+    if (!surface || !controller) {
+        bool saved = surface && encode_surface(surface, *imageStream.Obj(), format, compression);
+        if (callback) callback(saved);
+        return;
     }
 
-    std::vector<unsigned char> output;
+    // Decoded pixels are never modified, the worker only needs its own reference
+    cairo_surface_reference(surface);
+    INativeAsyncService* asyncService = controller->AsyncService();
+    asyncService->InvokeAsync([=]()
+    {
+        bool saved = encode_surface(surface, *imageStream.Obj(), format, compression);
+        cairo_surface_destroy(surface);
+        if (callback) {
+            asyncService->InvokeInMainThread(nullptr, [=]()
+            {
+                callback(saved);
+            });
+        }
+    });
+}
 
-    switch (format) {
-        case INativeImage::Png:
-            stbi_write_png_to_func(stbi_write_callback, &output, width, height, 4, rgba.data(), width * 4);
-            break;
-        case INativeImage::Jpeg:
-            stbi_write_jpg_to_func(stbi_write_callback, &output, width, height, 4, rgba.data(), 90);
-            break;
-        case INativeImage::Bmp:
-            stbi_write_bmp_to_func(stbi_write_callback, &output, width, height, 4, rgba.data());
-            break;
-        default:
-            // Default to PNG
-            stbi_write_png_to_func(stbi_write_callback, &output, width, height, 4, rgba.data(), width * 4);
-            break;
+// Decode unless the disk cache already has the pixels, and write new results to it.
+// Workers get a standalone surface, which the UI thread packs when an image takes it.
+// The UI thread gets a packed surface and leaves writing the disk cache to the thread pool.
+static cairo_surface_t* decode_with_disk_cache(Ptr<WGacImageDiskCache> diskCache, vuint64_t key, const unsigned char* data, vint length, Size maxSize, bool mainThread)
+{
+    if (diskCache) {
+        if (auto surface = diskCache->Load(key)) {
+            return mainThread ? pack_surface(surface) : surface;
+        }
+    }
+
+    cairo_surface_t* surface = decode_to_surface_at_size(data, length, maxSize);
+    if (!surface || !diskCache) {
+        return mainThread ? pack_surface(surface) : surface;
     }
 
-    if (!output.empty()) {
-        imageStream.Write(output.data(), output.size());
+    auto controller = GetCurrentController();
+    if (mainThread && controller) {
+        // Pack before the worker starts reading, afterwards only the worker uses the standalone surface
+        cairo_surface_t* standalone = cairo_surface_reference(surface);
+        surface = pack_surface(surface);
+        controller->AsyncService()->InvokeAsync([=]()
+        {
+            diskCache->Store(key, standalone);
+            cairo_surface_destroy(standalone);
+        });
+        return surface;
     }
+    diskCache->Store(key, surface);
+    return mainThread ? pack_surface(surface) : surface;
 }
 
 // WGacImageService implementation
-Ptr<INativeImage> WGacImageService::CreateImageFromFile(const WString& path)
+WGacImageService::WGacImageService()
+    : decodedCache(new WGacDecodedImageCache)
+    , memoryBudget(new WGacImageMemoryBudget)
 {
-    AString apath = wtoa(path);
-    std::vector<unsigned char> fileData = read_file(apath.Buffer());
+}
+
+Ptr<INativeImage> WGacImageService::CreateCachedImage(const WGacDecodedImageCache::Entry& entry, vuint64_t key, Size maxSize)
+{
+    auto image = Ptr(new WGacImage(this, entry.surface));
+    image->SetFormat(entry.format);
+    image->SetCacheEntry(decodedCache, key);
+    image->SetRedecodeSource(entry.encoded, memoryBudget, maxSize);
+    return image;
+}
+
+Ptr<INativeImage> WGacImageService::LookupCached(vuint64_t key, Size maxSize, bool waitPending)
+{
+    if (waitPending) {
+        decodedCache->WaitPending(key);
+    }
+    WGacDecodedImageCache::Entry entry;
+    if (decodedCache->Lookup(key, entry)) {
+        return CreateCachedImage(entry, key, maxSize);
+    }
+    return nullptr;
+}
 
-    if (fileData.empty()) {
+Ptr<INativeImage> WGacImageService::CreateAnimatedImage(const unsigned char* data, vint length, Ptr<WGacEncodedImage> encoded)
+{
+    Size size;
+    collections::List<vint> delays;
+    bool restoresPrevious = false;
+    if (!scan_gif(data, length, size, delays, &restoresPrevious) || delays.Count() < 2) {
         return nullptr;
     }
 
-    return CreateImageFromMemory(fileData.data(), fileData.size());
+    // Frames are decoded later, so the bytes have to stay valid
+    if (!encoded) {
+        encoded = WGacEncodedImage::CopyMemory(data, length);
+    }
+    auto decoder = Ptr(new WGacGifDecoder(encoded));
+    decoder->size = size;
+    decoder->restoresPrevious = restoresPrevious;
+    CopyFrom(decoder->delays, delays);
+    return Ptr(new WGacImage(this, decoder));
 }
 
-Ptr<INativeImage> WGacImageService::CreateImageFromMemory(void* buffer, vint length)
+Ptr<INativeImage> WGacImageService::DecodeCached(const unsigned char* data, vint length, vuint64_t key, Ptr<WGacEncodedImage> encoded, Size maxSize)
 {
-    int width, height, channels;
-    unsigned char* pixels = stbi_load_from_memory(
-        static_cast<const unsigned char*>(buffer),
-        static_cast<int>(length),
-        &width, &height, &channels, 4  // Force RGBA
-    );
+    // Thumbnails only show the first frame
+    bool thumbnail = maxSize.x > 0 && maxSize.y > 0;
+    if (!thumbnail) {
+        if (auto image = CreateAnimatedImage(data, length, encoded)) {
+            return image;
+        }
+    }
 
-    if (!pixels) {
+    WGacDecodedImageCache::Entry entry;
+    entry.surface = decode_with_disk_cache(diskCache, key, data, length, maxSize, true);
+    if (!entry.surface) {
         return nullptr;
     }
+    // The compressed bytes are kept so that the pixels can be dropped under memory pressure
+    entry.format = detect_format(data, length);
+    entry.encoded = encoded ? encoded : WGacEncodedImage::CopyMemory(data, length);
+    if (decodedCache->Insert(key, entry)) {
+        return CreateCachedImage(entry, key, maxSize);
+    }
+    auto image = Ptr(new WGacImage(this, entry.surface));
+    image->SetFormat(entry.format);
+    image->SetRedecodeSource(entry.encoded, memoryBudget, maxSize);
+    return image;
+}
 
-    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-        stbi_image_free(pixels);
+Ptr<INativeImage> WGacImageService::DecodeCachedAsync(Ptr<WGacEncodedImage> header, vuint64_t key, const Func<Ptr<WGacEncodedImage>()>& load)
+{
+    auto controller = GetCurrentController();
+    if (!controller || !controller->AsyncService()) {
+        auto encoded = load();
+        if (!encoded) {
+            return nullptr;
+        }
+        return DecodeCached(encoded->GetData(), encoded->GetLength(), key, encoded);
+    }
+
+    // Animated images decode frames on demand anyway
+    if (auto image = CreateAnimatedImage(header->GetData(), header->GetLength(), header)) {
+        return image;
+    }
+
+    // Only the header is parsed here, so the caller knows the size right away
+    int width, height, channels;
+    if (!stbi_info_from_memory(header->GetData(), static_cast<int>(header->GetLength()), &width, &height, &channels)) {
         return nullptr;
     }
 
-    copy_rgba_to_surface(pixels, width, height, surface);
-    stbi_image_free(pixels);
+    INativeImage::FormatType format = detect_format(header->GetData(), header->GetLength());
+    auto image = Ptr(new WGacImage(this, Size(width, height)));
+    image->SetFormat(format);
+    auto cache = decodedCache;
+    auto disk = diskCache;
+    auto budget = memoryBudget;
+
+    INativeAsyncService* asyncService = controller->AsyncService();
+    asyncService->InvokeAsync([=]()
+    {
+        // A prefetch of the same key is waited for here rather than on the UI thread, and its pixels are shared
+        cache->WaitPending(key);
+        Ptr<WGacEncodedImage> cached;
+        if (cache->Reserve(key, cached)) {
+            image->SetDecodedFromCache(cache, key);
+            asyncService->InvokeInMainThread(nullptr, [=]()
+            {
+                image->SetRedecodeSource(cached, budget);
+                image->NotifyDecoded();
+            });
+            return;
+        }
+
+        // Reading the bytes stays off the UI thread
+        auto encoded = load();
+        image->SetDecodedSurface(encoded ? decode_with_disk_cache(disk, key, encoded->GetData(), encoded->GetLength(), Size(), false) : nullptr);
+        asyncService->InvokeInMainThread(nullptr, [=]()
+        {
+            if (encoded) {
+                image->SetRedecodeSource(encoded, budget);
+            }
+            image->NotifyDecoded();
+            auto frame = dynamic_cast<WGacImageFrame*>(image->GetFrame(0));
+            if (!frame || !frame->IsSurfaceLoaded()) return;
+
+            WGacDecodedImageCache::Entry entry;
+            entry.surface = frame->GetSurface();
+            entry.format = format;
+            entry.encoded = encoded;
+            if (cache->Insert(key, entry)) {
+                image->SetCacheEntry(cache, key);
+            }
+        });
+    });
+    return image;
+}
+
+Ptr<INativeImage> WGacImageService::DecodeCachedAsync(Ptr<WGacEncodedImage> encoded, vuint64_t key)
+{
+    return DecodeCachedAsync(encoded, key, [=]()
+    {
+        return encoded;
+    });
+}
+
+Ptr<INativeImage> WGacImageService::CreateImageFromFile(const WString& path)
+{
+    vuint64_t key = 0;
+    if (!file_cache_key(path, key)) {
+        return nullptr;
+    }
+    if (auto image = LookupCached(key)) {
+        return image;
+    }
+
+    auto encoded = WGacEncodedImage::ReadFile(path);
+    if (!encoded) {
+        return nullptr;
+    }
+    return DecodeCached(encoded->GetData(), encoded->GetLength(), key, encoded);
+}
 
-    return Ptr(new WGacImage(this, surface));
+Ptr<INativeImage> WGacImageService::CreateImageFromMemory(void* buffer, vint length)
+{
+    if (!buffer || length <= 0) {
+        return nullptr;
+    }
+    auto data = static_cast<const unsigned char*>(buffer);
+    vuint64_t key = WGacDecodedImageCache::HashBytes(data, length);
+    if (auto image = LookupCached(key)) {
+        return image;
+    }
+    return DecodeCached(data, length, key, nullptr);
 }
 
 Ptr<INativeImage> WGacImageService::CreateImageFromStream(stream::IStream& imageStream)
 {
-    std::vector<char> buffer;
-    char chunk[4096];
-    while (true) {
-        vint bytesRead = imageStream.Read(chunk, sizeof(chunk));
-        if (bytesRead == 0) break;
-        buffer.insert(buffer.end(), chunk, chunk + bytesRead);
+    auto encoded = WGacEncodedImage::ReadStream(imageStream);
+    if (!encoded) {
+        return nullptr;
+    }
+    return CreateImageFromEncoded(encoded);
+}
+
+Ptr<INativeImage> WGacImageService::CreateImageFromEncoded(Ptr<WGacEncodedImage> encoded)
+{
+    vuint64_t key = WGacDecodedImageCache::HashBytes(encoded->GetData(), encoded->GetLength());
+    if (auto image = LookupCached(key)) {
+        return image;
+    }
+    return DecodeCached(encoded->GetData(), encoded->GetLength(), key, encoded);
+}
+
+// Bytes read from the start of a file to parse its header on the calling thread
+static const vint AsyncHeaderLength = 64 * 1024;
+
+Ptr<INativeImage> WGacImageService::CreateImageFromFileAsync(const WString& path)
+{
+    vuint64_t key = 0;
+    if (!file_cache_key(path, key)) {
+        return nullptr;
+    }
+    if (auto image = LookupCached(key, Size(), false)) {
+        return image;
+    }
+
+    // Only the start of the file is read here, the whole file is read on the thread pool
+    auto header = WGacEncodedImage::ReadFileHead(path, AsyncHeaderLength);
+    if (!header) {
+        return nullptr;
+    }
+    if (header->GetLength() < AsyncHeaderLength) {
+        return DecodeCachedAsync(header, key);
+    }
+    int width, height, channels;
+    bool parsed = stbi_info_from_memory(header->GetData(), static_cast<int>(header->GetLength()), &width, &height, &channels);
+    // GIFs need every frame to tell animated ones apart, and some JPEGs put their size behind large metadata
+    if (!parsed || detect_format(header->GetData(), header->GetLength()) == INativeImage::Gif) {
+        auto encoded = WGacEncodedImage::ReadFile(path);
+        if (!encoded) {
+            return nullptr;
+        }
+        return DecodeCachedAsync(encoded, key);
     }
+    return DecodeCachedAsync(header, key, [=]()
+    {
+        return WGacEncodedImage::ReadFile(path);
+    });
+}
+
+Ptr<INativeImage> WGacImageService::CreateImageFromMemoryAsync(void* buffer, vint length)
+{
+    if (!buffer || length <= 0) {
+        return nullptr;
+    }
+    vuint64_t key = WGacDecodedImageCache::HashBytes(buffer, length);
+    if (auto image = LookupCached(key, Size(), false)) {
+        return image;
+    }
+
+    // The caller's buffer is not guaranteed to outlive the decoding
+    return DecodeCachedAsync(WGacEncodedImage::CopyMemory(buffer, length), key);
+}
+
+Ptr<INativeImage> WGacImageService::CreateImageFromEncodedAsync(Ptr<WGacEncodedImage> encoded)
+{
+    vuint64_t key = WGacDecodedImageCache::HashBytes(encoded->GetData(), encoded->GetLength());
+    if (auto image = LookupCached(key, Size(), false)) {
+        return image;
+    }
+    return DecodeCachedAsync(encoded, key);
+}
+
+WGacDecodedImageCache::Statistics WGacImageService::GetCacheStatistics()
+{
+    return decodedCache->GetStatistics();
+}
+
+// Thumbnails of the same source at different sizes are separate cache entries
+static vuint64_t sized_cache_key(vuint64_t key, Size maxSize)
+{
+    vuint64_t size = ((vuint64_t)(vuint32_t)maxSize.x << 32) | (vuint32_t)maxSize.y;
+    return hash_mix(key ^ size, 0x9e3779b97f4a7c15ULL);
+}
+
+Ptr<INativeImage> WGacImageService::CreateImageFromFileAtSize(const WString& path, Size maxSize)
+{
+    vuint64_t key = 0;
+    if (!file_cache_key(path, key)) {
+        return nullptr;
+    }
+    key = sized_cache_key(key, maxSize);
+    if (auto image = LookupCached(key, maxSize)) {
+        return image;
+    }
+
+    auto encoded = WGacEncodedImage::ReadFile(path);
+    if (!encoded) {
+        return nullptr;
+    }
+    return DecodeCached(encoded->GetData(), encoded->GetLength(), key, encoded, maxSize);
+}
 
-    if (buffer.empty()) {
+Ptr<INativeImage> WGacImageService::CreateImageFromMemoryAtSize(void* buffer, vint length, Size maxSize)
+{
+    if (!buffer || length <= 0) {
         return nullptr;
     }
+    auto data = static_cast<const unsigned char*>(buffer);
+    vuint64_t key = sized_cache_key(WGacDecodedImageCache::HashBytes(data, length), maxSize);
+    if (auto image = LookupCached(key, maxSize)) {
+        return image;
+    }
+    return DecodeCached(data, length, key, nullptr, maxSize);
+}
+
+vint WGacImageService::GetDecodedMemoryBudget()
+{
+    return memoryBudget->GetBudget();
+}
+
+void WGacImageService::SetDecodedMemoryBudget(vint bytes)
+{
+    memoryBudget->SetBudget(bytes);
+}
+
+vint WGacImageService::GetDecodedMemoryUsage()
+{
+    return memoryBudget->GetUsedBytes();
+}
+
+void WGacImageService::ReleaseDecodedMemory(vint targetBytes)
+{
+    memoryBudget->Trim(targetBytes);
+    decodedCache->ReleaseUnused();
+}
+
+void WGacImageService::Prefetch(vuint64_t key, Func<Ptr<WGacEncodedImage>()> load)
+{
+    auto cache = decodedCache;
+    auto disk = diskCache;
+    auto decode = [=]()
+    {
+        auto encoded = load();
+        // Animated GIFs decode frames on demand and are not cached
+        Size size;
+        collections::List<vint> delays;
+        if (encoded && !(scan_gif(encoded->GetData(), encoded->GetLength(), size, delays) && delays.Count() > 1)) {
+            WGacDecodedImageCache::Entry entry;
+            entry.surface = decode_with_disk_cache(disk, key, encoded->GetData(), encoded->GetLength(), Size(), false);
+            if (entry.surface) {
+                entry.format = detect_format(encoded->GetData(), encoded->GetLength());
+                entry.encoded = encoded;
+                // Nothing uses a prefetched entry until it is looked up
+                cache->Insert(key, entry, false);
+                cairo_surface_destroy(entry.surface);
+            }
+        }
+        cache->EndPending(key);
+    };
+
+    if (auto controller = GetCurrentController()) {
+        controller->AsyncService()->InvokeAsync(decode);
+    } else {
+        decode();
+    }
+}
+
+void WGacImageService::PrefetchImagesFromMemory(const collections::List<collections::Pair<const void*, vint>>& blobs)
+{
+    for (vint i = 0; i < blobs.Count(); i++) {
+        auto data = blobs[i].key;
+        auto length = blobs[i].value;
+        if (!data || length <= 0) continue;
+        // The blob is copied only when it is not cached yet
+        vuint64_t key = WGacDecodedImageCache::HashBytes(data, length);
+        if (!decodedCache->BeginPending(key)) continue;
+        auto encoded = WGacEncodedImage::CopyMemory(data, length);
+        Prefetch(key, [encoded]() { return encoded; });
+    }
+}
+
+void WGacImageService::PrefetchImagesFromFiles(const collections::List<WString>& paths)
+{
+    for (vint i = 0; i < paths.Count(); i++) {
+        vuint64_t key = 0;
+        if (!file_cache_key(paths[i], key)) continue;
+        if (!decodedCache->BeginPending(key)) continue;
+        WString path = paths[i];
+        Prefetch(key, [path]() { return WGacEncodedImage::ReadFile(path); });
+    }
+}
+
+bool WGacImageService::EnableDiskCache(const WString& directory, vint maxBytes)
+{
+    AString path = directory.Length() > 0 ? wtoa(directory) : WGacImageDiskCache::GetDefaultDirectory();
+    if (path.Length() == 0) {
+        return false;
+    }
+    diskCache = Ptr(new WGacImageDiskCache(path, maxBytes));
+    return true;
+}
 
-    return CreateImageFromMemory(buffer.data(), buffer.size());
+void WGacImageService::DisableDiskCache()
+{
+    diskCache = nullptr;
 }
 
 }
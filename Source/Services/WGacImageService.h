@@ -2,22 +2,176 @@
 #define WGAC_IMAGESERVICE_H
 
 #include "GacUI.h"
+#include "WGacImageEncoder.h"
 #include <cairo/cairo.h>
+#include <vector>
 
 namespace vl {
 namespace presentation {
 namespace wayland {
 
+// Image surfaces are ARGB32, RGB24 for opaque images, or A8 for images of a single colour,
+// in which case the colour is attached to the surface
+extern void SetImageMaskColor(cairo_surface_t* surface, Color color);
+extern bool GetImageMaskColor(cairo_surface_t* surface, Color& color);
+// Paints an image surface at the origin of the current transform with the cheapest operator for its format
+extern void PaintImageSurface(cairo_t* cr, cairo_surface_t* surface, cairo_filter_t filter, bool disabled);
+
+// Encoded bytes of an image, read once into memory. They are the decoding source and are kept
+// for decoding again, so files are read rather than mapped, a mapping would have to be copied
+// anyway to survive the file being truncated underneath.
+class WGacEncodedImage : public Object
+{
+protected:
+    std::vector<unsigned char> buffer;
+
+    WGacEncodedImage() = default;
+
+public:
+    WGacEncodedImage(const WGacEncodedImage&) = delete;
+    WGacEncodedImage& operator=(const WGacEncodedImage&) = delete;
+
+    static Ptr<WGacEncodedImage> ReadFile(const WString& path);
+    // Reads at most length bytes from the start of the file, enough to parse the header of most images
+    static Ptr<WGacEncodedImage> ReadFileHead(const WString& path, vint length);
+    static Ptr<WGacEncodedImage> CopyMemory(const void* data, vint length);
+    // Reads the rest of the stream, using its size as a capacity hint when known
+    static Ptr<WGacEncodedImage> ReadStream(stream::IStream& stream);
+
+    const unsigned char* GetData() const;
+    vint GetLength() const;
+};
+
+// Decoded surfaces shared between images created from the same encoded bytes or the same file.
+// The cache holds one reference per surface and counts the images using it, an entry goes with its last image.
+// References taken by background work such as disk stores or encoding do not keep an entry.
+class WGacDecodedImageCache : public Object
+{
+public:
+    struct Statistics
+    {
+        vint hits = 0;
+        vint misses = 0;
+        vint entries = 0;
+        vint bytes = 0;
+    };
+
+    struct Entry
+    {
+        cairo_surface_t* surface = nullptr;
+        INativeImage::FormatType format = INativeImage::Unknown;
+        Ptr<WGacEncodedImage> encoded;
+        vint bytes = 0;
+        // Images using the entry
+        vint users = 0;
+    };
+
+protected:
+    SpinLock lock;
+    collections::Dictionary<vuint64_t, Entry> entries;
+    // Keys being decoded by a prefetch, signaled when the entry is inserted or the decode failed
+    collections::Dictionary<vuint64_t, Ptr<EventObject>> pending;
+    Statistics statistics;
+
+public:
+    ~WGacDecodedImageCache();
+
+    // Returns false if the key is already cached or being decoded, otherwise the caller must call EndPending
+    bool BeginPending(vuint64_t key);
+    void EndPending(vuint64_t key);
+    // Blocks while a prefetch is decoding the key
+    void WaitPending(vuint64_t key);
+    // Callable from any thread. Makes the caller a user of a cached entry without taking its pixels,
+    // which the UI thread takes with Lookup followed by Release. Returns false if the key is not cached
+    bool Reserve(vuint64_t key, Ptr<WGacEncodedImage>& encoded);
+    // Drops entries no image is using, such as prefetched images that were never requested
+    void ReleaseUnused();
+
+    // Called on the UI thread. The surface in the returned entry is a new reference,
+    // the caller becomes a user of the entry
+    bool Lookup(vuint64_t key, Entry& entry);
+    // Returns false if the key is already taken, the cache adds its own reference otherwise,
+    // and the caller becomes a user of the entry unless use is false
+    bool Insert(vuint64_t key, const Entry& entry, bool use = true);
+    // Called when a user of the entry goes away or drops its pixels
+    void Release(vuint64_t key);
+    Statistics GetStatistics();
+
+    static vuint64_t HashBytes(const void* data, vint length, vuint64_t seed = 0);
+};
+
+// Opt-in cache of decoded, premultiplied pixels on disk, one file per decoded image cache key.
+// Files are mapped straight into cairo surfaces, so a warm start skips decoding.
+class WGacImageDiskCache : public Object
+{
+protected:
+    AString directory;
+    vint maxBytes;
+    SpinLock lock;
+    // Total size of the cache files, -1 until the directory has been scanned
+    vint totalBytes = -1;
+
+    AString GetPath(vuint64_t key);
+    vint ScanLocked();
+    void TrimLocked(vint targetBytes);
+
+public:
+    // Bump when the file layout or the meaning of the pixels changes, older files are then discarded
+    static const vuint32_t FormatVersion = 1;
+    static const vint DefaultMaxBytes = 256 * 1024 * 1024;
+
+    WGacImageDiskCache(const AString& directory, vint maxBytes);
+
+    // $XDG_CACHE_HOME/wgac, or ~/.cache/wgac
+    static AString GetDefaultDirectory();
+
+    // Returns nullptr if there is no valid file for the key
+    cairo_surface_t* Load(vuint64_t key);
+    void Store(vuint64_t key, cairo_surface_t* surface);
+    void Clear();
+};
+
+// Packs small decoded images into shared page surfaces with a shelf packer, one page format per page.
+// A packed image is an image surface over its rectangle of a page, so it works wherever a standalone surface does,
+// while PaintImageSurface paints it straight from the page. The page is freed with its last image.
+class WGacImageAtlas
+{
+public:
+    static const vint PageSize = 256;
+    static const vint MaxPackedSize = 64;
+
+protected:
+    struct Page;
+    struct Slot;
+    SpinLock lock;
+    // Pages with at least one packed image, a page leaves the list with its last image
+    collections::List<Ptr<Page>> pages;
+
+public:
+    // Returns a packed copy and releases the surface, or returns the surface itself if it is too large to pack.
+    // Called on the UI thread only, which is the thread painting the pages.
+    cairo_surface_t* Pack(cairo_surface_t* surface);
+    // Returns false if the surface is not packed
+    static bool GetRegion(cairo_surface_t* surface, cairo_surface_t*& page, Rect& region);
+    static WGacImageAtlas* GetShared();
+
+protected:
+    static void ReleaseSlot(void* slot);
+};
+
 class WGacImageFrame : public Object, public INativeImageFrame
 {
 protected:
     cairo_surface_t* surface;
     INativeImage* image;
     Size size;
+    vint index = 0;
     collections::Dictionary<void*, Ptr<INativeImageFrameCache>> caches;
 
 public:
     WGacImageFrame(INativeImage* image, cairo_surface_t* surface);
+    // Creates a frame whose pixels are decoded later
+    WGacImageFrame(INativeImage* image, Size size, vint index = 0);
     ~WGacImageFrame();
 
     INativeImage* GetImage() override;
@@ -26,33 +180,270 @@ public:
     Ptr<INativeImageFrameCache> GetCache(void* key) override;
     Ptr<INativeImageFrameCache> RemoveCache(void* key) override;
 
-    cairo_surface_t* GetSurface() { return surface; }
+    // Decodes the frame first if the image decodes frames on demand
+    cairo_surface_t* GetSurface();
+    bool IsSurfaceLoaded() { return surface != nullptr; }
+    void SetSurface(cairo_surface_t* surface);
+    // The atlas page and the rectangle of it holding the frame, false if the frame has its own surface
+    bool GetAtlasRegion(cairo_surface_t*& page, Rect& region);
+};
+
+// Copies of a frame resampled to the device sizes it has been drawn at, and their disabled looks,
+// so that stretched, HiDPI or disabled draws become a single 1:1 blit after the first frame
+class WGacImageFrameVariants : public Object, public INativeImageFrameCache
+{
+protected:
+    struct Variant
+    {
+        Size deviceSize;
+        bool disabled = false;
+        cairo_surface_t* surface = nullptr;
+        vuint64_t lastUsed = 0;
+    };
+
+    WGacImageFrame* frame = nullptr;
+    collections::List<Variant> variants;
+    vint totalBytes = 0;
+    vuint64_t useCounter = 0;
+
+    void EvictFor(vint requiredBytes);
+    cairo_surface_t* Find(Size deviceSize, bool disabled);
+    cairo_surface_t* Store(Size deviceSize, bool disabled, cairo_surface_t* surface);
+
+public:
+    // Upper bound of resampled pixels kept for a single frame
+    static const vint MaxBytesPerFrame = 16 * 1024 * 1024;
+
+    ~WGacImageFrameVariants();
+
+    void OnAttach(INativeImageFrame* frame) override;
+    void OnDetach(INativeImageFrame* frame) override;
+
+    // Returns a surface of exactly deviceSize pixels, or nullptr if it would exceed the cap
+    cairo_surface_t* GetVariant(Size deviceSize, bool disabled);
+    void Clear();
+
+    static WGacImageFrameVariants* GetOrCreate(WGacImageFrame* frame);
+};
+
+class WGacGifDecoder;
+class WGacImage;
+
+// Decoded pixels of still images, ordered by when they were last drawn.
+// Over the budget the least recently drawn images drop their surfaces,
+// and decode them again from the encoded bytes they keep when drawn next time.
+class WGacImageMemoryBudget : public Object
+{
+protected:
+    // Images sharing pixels through the decoded image cache are charged once for them, and drop them together
+    struct Charge : public Object
+    {
+        cairo_surface_t* surface = nullptr;
+        vint bytes = 0;
+        collections::List<WGacImage*> images;
+        Charge* prev = nullptr;
+        Charge* next = nullptr;
+    };
+
+    SpinLock lock;
+    collections::Dictionary<cairo_surface_t*, Ptr<Charge>> charges;
+    Charge* mostRecent = nullptr;
+    Charge* leastRecent = nullptr;
+    vint budget;
+    vint usedBytes = 0;
+
+    void Link(Charge* charge);
+    void Unlink(Charge* charge);
+    void EvictLocked(vint targetBytes, Charge* keep);
+
+public:
+    static const vint DefaultBudget = 256 * 1024 * 1024;
+
+    WGacImageMemoryBudget();
+
+    // Charges the pixels drawn by the image, unless another image already uses the same surface
+    void Add(WGacImage* image, cairo_surface_t* surface);
+    void Remove(WGacImage* image);
+    // Marks the pixels of the image as the most recently drawn
+    void Touch(WGacImage* image);
+
+    vint GetBudget();
+    void SetBudget(vint bytes);
+    vint GetUsedBytes();
+    // Drops the least recently drawn images until at most targetBytes remain, without changing the budget
+    void Trim(vint targetBytes);
 };
 
 class WGacImage : public Object, public INativeImage
 {
+    friend class WGacImageMemoryBudget;
 protected:
     INativeImageService* imageService;
     collections::Array<Ptr<WGacImageFrame>> frames;
     FormatType formatType;
 
+    // Animated images decode frames on demand and keep only as many as fit in frameBudget
+    Ptr<WGacGifDecoder> gifDecoder;
+    collections::Array<vint> frameDelays;
+    vint frameBudget;
+    vint decodedFrameBytes = 0;
+
+    void EvictFramesFor(vint index, vint bytes);
+
+    // Asynchronous decoding state, the worker fills pendingSurface and the UI thread installs it
+    SpinLock decodingLock;
+    EventObject decodedEvent;
+    bool decoded;
+    // Set when the encoded bytes failed to decode, they are never decoded again
+    bool decodeFailed = false;
+    cairo_surface_t* pendingSurface;
+    // Set instead of pendingSurface when the worker found the pixels in the decoded image cache
+    Ptr<WGacDecodedImageCache> pendingCache;
+    vuint64_t pendingCacheKey = 0;
+    collections::List<Func<void()>> decodedCallbacks;
+
+    Ptr<WGacDecodedImageCache> cache;
+    vuint64_t cacheKey = 0;
+    // Whether the image is counted as a user of the cache entry
+    bool cacheUser = false;
+
+    // Still images keep their encoded bytes and may drop their pixels under memory pressure
+    Ptr<WGacEncodedImage> encoded;
+    Size decodeMaxSize;
+    Ptr<WGacImageMemoryBudget> budget;
+    // The surface the budget charges the image for, guarded by the lock of the budget
+    cairo_surface_t* budgetSurface = nullptr;
+    // Set while a background decode brings back dropped pixels, guarded by decodingLock
+    bool redecoding = false;
+    // Lets a finished background decode find out whether the image still exists
+    struct AliveToken : public Object
+    {
+        WGacImage* image = nullptr;
+    };
+    Ptr<AliveToken> self;
+
+    bool InstallPendingSurface();
+    void TrackDecodedSurface();
+    // Called by WGacImageMemoryBudget with its lock held
+    void DropDecodedSurface();
+    void InstallRedecodedSurface(cairo_surface_t* surface);
+    void RunDecodedCallbacks();
+    void ReleaseCacheEntry();
+    // The first frame with its pixels decoded, for saving
+    cairo_surface_t* GetEncodableSurface();
+
 public:
     WGacImage(INativeImageService* service, cairo_surface_t* surface);
+    // Creates an image whose pixels are still being decoded
+    WGacImage(INativeImageService* service, Size size);
+    // Creates an animated image whose frames are decoded on demand
+    WGacImage(INativeImageService* service, Ptr<WGacGifDecoder> decoder);
     ~WGacImage();
 
+    // Default upper bound of decoded frame pixels kept for an animated image
+    static const vint DefaultFrameBudget = 32 * 1024 * 1024;
+
+    void SetFormat(FormatType format);
+    // Display time of a frame in milliseconds, 0 for still images
+    vint GetFrameDelay(vint index);
+    vint GetFrameBudget();
+    void SetFrameBudget(vint bytes);
+    // Called by WGacImageFrame::GetSurface for frames that are not decoded yet
+    void DecodeFrame(vint index);
+
+    bool IsDecoded();
+    // Whether the pixels are being decoded in the background, the first time or after the memory budget dropped them
+    bool IsDecoding();
+    // Blocks until the pixels are available
+    void WaitForDecoding();
+    // Called in the UI thread once the pixels are available, or immediately if they already are,
+    // including when pixels dropped by the memory budget come back from a background decode
+    void OnDecoded(const Func<void()>& callback);
+    // Called by the decoding worker
+    void SetDecodedSurface(cairo_surface_t* surface);
+    // Called by the decoding worker after reserving the entry of the key in the decoded image cache
+    void SetDecodedFromCache(Ptr<WGacDecodedImageCache> cache, vuint64_t key);
+    // Called in the UI thread after SetDecodedSurface or SetDecodedFromCache
+    void NotifyDecoded();
+    // Called by the image service when the pixels are shared through the decoded image cache,
+    // after a Lookup or Insert that made the image a user of the entry
+    void SetCacheEntry(Ptr<WGacDecodedImageCache> cache, vuint64_t key);
+    // Called by the image service to let the pixels be dropped and decoded again from the encoded bytes
+    void SetRedecodeSource(Ptr<WGacEncodedImage> encoded, Ptr<WGacImageMemoryBudget> budget, Size maxSize = Size());
+    // Brings back pixels dropped by the memory budget, a background decode is started if async is true
+    void RestoreDecodedSurface(bool async);
+    // Called by WGacImageFrame::GetSurface when the pixels are used
+    void TouchDecodedSurface();
+
     INativeImageService* GetImageService() override;
     FormatType GetFormat() override;
     vint GetFrameCount() override;
     INativeImageFrame* GetFrame(vint index) override;
     void SaveToStream(stream::IStream& stream, FormatType formatType) override;
+    bool SaveToStream(stream::IStream& stream, FormatType formatType, WGacPngCompression compression);
+    // Encodes on the thread pool, the callback runs on the UI thread with whether the stream was written
+    void SaveToStreamAsync(Ptr<stream::IStream> stream, FormatType formatType, WGacPngCompression compression, const Func<void(bool)>& callback);
 };
 
 class WGacImageService : public Object, public INativeImageService
 {
+protected:
+    Ptr<WGacDecodedImageCache> decodedCache;
+    Ptr<WGacImageMemoryBudget> memoryBudget;
+    Ptr<WGacImageDiskCache> diskCache;
+
+    Ptr<INativeImage> CreateCachedImage(const WGacDecodedImageCache::Entry& entry, vuint64_t key, Size maxSize = Size());
+    // Waits for a prefetch decoding the key unless waitPending is false
+    Ptr<INativeImage> LookupCached(vuint64_t key, Size maxSize = Size(), bool waitPending = true);
+    // Returns an animated image for GIFs with more than one frame, encoded may be null for borrowed bytes
+    Ptr<INativeImage> CreateAnimatedImage(const unsigned char* data, vint length, Ptr<WGacEncodedImage> encoded);
+    Ptr<INativeImage> DecodeCached(const unsigned char* data, vint length, vuint64_t key, Ptr<WGacEncodedImage> encoded, Size maxSize = Size());
+    // Parses the header on the calling thread and calls load on the thread pool for the bytes to decode.
+    // GIFs need all of their bytes in header, to tell animated ones apart.
+    // Without an async service, load is called and the bytes are decoded right away.
+    Ptr<INativeImage> DecodeCachedAsync(Ptr<WGacEncodedImage> header, vuint64_t key, const Func<Ptr<WGacEncodedImage>()>& load);
+    Ptr<INativeImage> DecodeCachedAsync(Ptr<WGacEncodedImage> encoded, vuint64_t key);
+    // Decodes on the thread pool, the caller has called BeginPending on the key
+    void Prefetch(vuint64_t key, Func<Ptr<WGacEncodedImage>()> load);
+
 public:
+    WGacImageService();
+
     Ptr<INativeImage> CreateImageFromFile(const WString& path) override;
     Ptr<INativeImage> CreateImageFromMemory(void* buffer, vint length) override;
     Ptr<INativeImage> CreateImageFromStream(stream::IStream& stream) override;
+
+    // Read the size from the image header and decode the pixels on the thread pool,
+    // the returned image is WGacImage and reports completion through WGacImage::OnDecoded
+    Ptr<INativeImage> CreateImageFromFileAsync(const WString& path);
+    Ptr<INativeImage> CreateImageFromMemoryAsync(void* buffer, vint length);
+
+    Ptr<INativeImage> CreateImageFromEncoded(Ptr<WGacEncodedImage> encoded);
+    Ptr<INativeImage> CreateImageFromEncodedAsync(Ptr<WGacEncodedImage> encoded);
+
+    // Decode directly to a still image that fits in maxSize keeping the aspect ratio, never enlarged.
+    // JPEGs are scaled inside the DCT, the full resolution pixels are never kept.
+    Ptr<INativeImage> CreateImageFromFileAtSize(const WString& path, Size maxSize);
+    Ptr<INativeImage> CreateImageFromMemoryAtSize(void* buffer, vint length, Size maxSize);
+
+    WGacDecodedImageCache::Statistics GetCacheStatistics();
+
+    // Upper bound of decoded pixels kept for still images
+    vint GetDecodedMemoryBudget();
+    void SetDecodedMemoryBudget(vint bytes);
+    vint GetDecodedMemoryUsage();
+    // Low memory hook, drops the pixels of the least recently drawn images until at most targetBytes remain
+    void ReleaseDecodedMemory(vint targetBytes = 0);
+
+    // Decode image blobs in parallel on the thread pool into the decoded image cache.
+    // Later CreateImageFromMemory / CreateImageFromStream / CreateImageFromFile calls for the same bytes
+    // return the prefetched pixels, waiting for them if they are still being decoded.
+    void PrefetchImagesFromMemory(const collections::List<collections::Pair<const void*, vint>>& blobs);
+    void PrefetchImagesFromFiles(const collections::List<WString>& paths);
+
+    // Keeps decoded pixels on disk across runs, an empty directory means WGacImageDiskCache::GetDefaultDirectory
+    bool EnableDiskCache(const WString& directory = WString::Empty, vint maxBytes = WGacImageDiskCache::DefaultMaxBytes);
+    void DisableDiskCache();
 };
 
 }
@@ -0,0 +1,531 @@
+#include "WGacPixelKernels.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WGAC_PIXEL_KERNELS_X86
+#define WGAC_TARGET_SSE2 __attribute__((target("sse2")))
+#define WGAC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace vl {
+namespace presentation {
+namespace wayland {
+
+namespace {
+
+//========================================[Scalar]========================================
+
+// x * a / 255 rounded, exact for every 8 bit input
+inline uint32_t premultiply_channel(uint32_t c, uint32_t a)
+{
+    uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+inline uint32_t unpremultiply_channel(uint32_t c, uint32_t a)
+{
+    uint32_t v = (c * 255 + a / 2) / a;
+    return v > 255 ? 255 : v;
+}
+
+// Luma weights (BT.601, sum to 256), gray is then blended halfway to the pixel's alpha,
+// which is white in premultiplied space and leaves transparent pixels transparent
+inline uint32_t disable_pixel(uint32_t pixel)
+{
+    uint32_t a = pixel >> 24;
+    uint32_t r = (pixel >> 16) & 0xFF;
+    uint32_t g = (pixel >> 8) & 0xFF;
+    uint32_t b = pixel & 0xFF;
+    uint32_t gray = (r * 77 + g * 150 + b * 29 + 128) >> 8;
+    uint32_t c = (gray + a) >> 1;
+    return (a << 24) | (c << 16) | (c << 8) | c;
+}
+
+template<bool SourceIsBgra>
+void premultiply_scalar(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t r = src[i * 4 + (SourceIsBgra ? 2 : 0)];
+        uint32_t g = src[i * 4 + 1];
+        uint32_t b = src[i * 4 + (SourceIsBgra ? 0 : 2)];
+        uint32_t a = src[i * 4 + 3];
+        dst[i] = (a << 24) | (premultiply_channel(r, a) << 16) | (premultiply_channel(g, a) << 8) | premultiply_channel(b, a);
+    }
+}
+
+template<bool TargetIsBgra>
+void unpremultiply_scalar(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t pixel = src[i];
+        uint32_t a = pixel >> 24;
+        uint32_t r = (pixel >> 16) & 0xFF;
+        uint32_t g = (pixel >> 8) & 0xFF;
+        uint32_t b = pixel & 0xFF;
+        if (a == 0) {
+            r = g = b = 0;
+        } else if (a < 255) {
+            r = unpremultiply_channel(r, a);
+            g = unpremultiply_channel(g, a);
+            b = unpremultiply_channel(b, a);
+        }
+        dst[i * 4 + 0] = static_cast<uint8_t>(TargetIsBgra ? b : r);
+        dst[i * 4 + 1] = static_cast<uint8_t>(g);
+        dst[i * 4 + 2] = static_cast<uint8_t>(TargetIsBgra ? r : b);
+        dst[i * 4 + 3] = static_cast<uint8_t>(a);
+    }
+}
+
+void expand_rgb_scalar(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = 0xFF000000u | (uint32_t(src[i * 3]) << 16) | (uint32_t(src[i * 3 + 1]) << 8) | src[i * 3 + 2];
+    }
+}
+
+void unpremultiply_rgb_scalar(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    uint8_t rgba[4];
+    for (size_t i = 0; i < count; i++) {
+        unpremultiply_scalar<false>(src + i, rgba, 1);
+        dst[i * 3 + 0] = rgba[0];
+        dst[i * 3 + 1] = rgba[1];
+        dst[i * 3 + 2] = rgba[2];
+    }
+}
+
+void disable_scalar(const uint32_t* src, uint32_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = disable_pixel(src[i]);
+    }
+}
+
+#ifdef WGAC_PIXEL_KERNELS_X86
+
+//========================================[SSE2]========================================
+
+// Premultiply two pixels widened to 16 bit lanes (R G B A or B G R A), alpha lanes multiply by 255
+template<bool SwapRB>
+WGAC_TARGET_SSE2 inline __m128i premultiply_epi16_sse2(__m128i px)
+{
+    const __m128i colorMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alphaLanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i round = _mm_set1_epi16(128);
+
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_or_si128(_mm_and_si128(a, colorMask), alphaLanes);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(px, a), round);
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    if (SwapRB) {
+        t = _mm_shufflehi_epi16(_mm_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+    }
+    return t;
+}
+
+template<bool SourceIsBgra>
+WGAC_TARGET_SSE2 void premultiply_sse2(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        __m128i lo = premultiply_epi16_sse2<!SourceIsBgra>(_mm_unpacklo_epi8(v, zero));
+        __m128i hi = premultiply_epi16_sse2<!SourceIsBgra>(_mm_unpackhi_epi8(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    premultiply_scalar<SourceIsBgra>(src + i * 4, dst + i, count - i);
+}
+
+// Unpremultiply four pixels, returns them in the input ARGB32 layout with straight alpha
+WGAC_TARGET_SSE2 inline __m128i unpremultiply_sse2_4(__m128i v)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128 v255 = _mm_set1_ps(255.0f);
+
+    __m128i a = _mm_srli_epi32(v, 24);
+    __m128 af = _mm_cvtepi32_ps(a);
+    // 255 / a, and 0 where a is 0 so that fully transparent pixels become 0
+    __m128 scale = _mm_and_ps(_mm_div_ps(v255, af), _mm_cmpneq_ps(af, _mm_setzero_ps()));
+
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+    __m128i b = _mm_and_si128(v, mask);
+    r = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(r), scale), v255));
+    g = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(g), scale), v255));
+    b = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(b), scale), v255));
+
+    __m128i out = _mm_or_si128(_mm_slli_epi32(a, 24), _mm_slli_epi32(r, 16));
+    return _mm_or_si128(out, _mm_or_si128(_mm_slli_epi32(g, 8), b));
+}
+
+// Swap the R and B bytes of ARGB32 pixels
+WGAC_TARGET_SSE2 inline __m128i swap_rb_sse2(__m128i v)
+{
+    const __m128i agMask = _mm_set1_epi32(0xFF00FF00);
+    const __m128i rbMask = _mm_set1_epi32(0x000000FF);
+    __m128i ag = _mm_and_si128(v, agMask);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), rbMask);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(v, rbMask), 16);
+    return _mm_or_si128(ag, _mm_or_si128(r, b));
+}
+
+template<bool TargetIsBgra>
+WGAC_TARGET_SSE2 void unpremultiply_sse2(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = unpremultiply_sse2_4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        // ARGB32 in memory is already B G R A
+        if (!TargetIsBgra) {
+            v = swap_rb_sse2(v);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), v);
+    }
+    unpremultiply_scalar<TargetIsBgra>(src + i, dst + i * 4, count - i);
+}
+
+WGAC_TARGET_SSE2 void disable_sse2(const uint32_t* src, uint32_t* dst, size_t count)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i wr = _mm_set1_epi32(77);
+    const __m128i wg = _mm_set1_epi32(150);
+    const __m128i wb = _mm_set1_epi32(29);
+    const __m128i round = _mm_set1_epi32(128);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i a = _mm_srli_epi32(v, 24);
+        __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+        __m128i b = _mm_and_si128(v, mask);
+
+        // Every product and the sum fit in the low 16 bits of each lane
+        __m128i gray = _mm_add_epi32(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg));
+        gray = _mm_add_epi32(gray, _mm_mullo_epi16(b, wb));
+        gray = _mm_srli_epi32(_mm_add_epi32(gray, round), 8);
+        __m128i c = _mm_srli_epi32(_mm_add_epi32(gray, a), 1);
+
+        __m128i out = _mm_or_si128(_mm_slli_epi32(a, 24), _mm_slli_epi32(c, 16));
+        out = _mm_or_si128(out, _mm_or_si128(_mm_slli_epi32(c, 8), c));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+    disable_scalar(src + i, dst + i, count - i);
+}
+
+//========================================[AVX2]========================================
+
+template<bool SwapRB>
+WGAC_TARGET_AVX2 inline __m256i premultiply_epi16_avx2(__m256i px)
+{
+    const __m256i colorMask = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+    const __m256i alphaLanes = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+    const __m256i round = _mm256_set1_epi16(128);
+
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm256_or_si256(_mm256_and_si256(a, colorMask), alphaLanes);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(px, a), round);
+    t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    if (SwapRB) {
+        t = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+    }
+    return t;
+}
+
+template<bool SourceIsBgra>
+WGAC_TARGET_AVX2 void premultiply_avx2(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+        // Unpack and pack both work within 128 bit lanes, so the pixel order is preserved
+        __m256i lo = premultiply_epi16_avx2<!SourceIsBgra>(_mm256_unpacklo_epi8(v, zero));
+        __m256i hi = premultiply_epi16_avx2<!SourceIsBgra>(_mm256_unpackhi_epi8(v, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    premultiply_scalar<SourceIsBgra>(src + i * 4, dst + i, count - i);
+}
+
+WGAC_TARGET_AVX2 inline __m256i unpremultiply_avx2_8(__m256i v)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m256 v255 = _mm256_set1_ps(255.0f);
+
+    __m256i a = _mm256_srli_epi32(v, 24);
+    __m256 af = _mm256_cvtepi32_ps(a);
+    __m256 scale = _mm256_and_ps(_mm256_div_ps(v255, af), _mm256_cmp_ps(af, _mm256_setzero_ps(), _CMP_NEQ_OQ));
+
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+    __m256i b = _mm256_and_si256(v, mask);
+    r = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(r), scale), v255));
+    g = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(g), scale), v255));
+    b = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(b), scale), v255));
+
+    __m256i out = _mm256_or_si256(_mm256_slli_epi32(a, 24), _mm256_slli_epi32(r, 16));
+    return _mm256_or_si256(out, _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+}
+
+template<bool TargetIsBgra>
+WGAC_TARGET_AVX2 void unpremultiply_avx2(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    const __m256i swapRB = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = unpremultiply_avx2_8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        if (!TargetIsBgra) {
+            v = _mm256_shuffle_epi8(v, swapRB);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), v);
+    }
+    unpremultiply_scalar<TargetIsBgra>(src + i, dst + i * 4, count - i);
+}
+
+WGAC_TARGET_AVX2 void expand_rgb_avx2(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    // Four RGB pixels (12 bytes) to four B G R A pixels, alpha comes from the OR below
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    size_t i = 0;
+    // Each load reads 16 bytes but consumes 12, stop early enough to stay inside src
+    for (; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+        v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+    expand_rgb_scalar(src + i * 3, dst + i, count - i);
+}
+
+WGAC_TARGET_AVX2 void unpremultiply_rgb_avx2(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    // Eight B G R A pixels to 24 R G B bytes, packed per 128 bit lane into the low 12 bytes
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = unpremultiply_avx2_8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        v = _mm256_shuffle_epi8(v, shuffle);
+        alignas(32) uint8_t packed[32];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(packed), v);
+        memcpy(dst + i * 3, packed, 12);
+        memcpy(dst + i * 3 + 12, packed + 16, 12);
+    }
+    unpremultiply_rgb_scalar(src + i, dst + i * 3, count - i);
+}
+
+WGAC_TARGET_AVX2 void disable_avx2(const uint32_t* src, uint32_t* dst, size_t count)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m256i wr = _mm256_set1_epi32(77);
+    const __m256i wg = _mm256_set1_epi32(150);
+    const __m256i wb = _mm256_set1_epi32(29);
+    const __m256i round = _mm256_set1_epi32(128);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i a = _mm256_srli_epi32(v, 24);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+        __m256i b = _mm256_and_si256(v, mask);
+
+        __m256i gray = _mm256_add_epi32(_mm256_mullo_epi16(r, wr), _mm256_mullo_epi16(g, wg));
+        gray = _mm256_add_epi32(gray, _mm256_mullo_epi16(b, wb));
+        gray = _mm256_srli_epi32(_mm256_add_epi32(gray, round), 8);
+        __m256i c = _mm256_srli_epi32(_mm256_add_epi32(gray, a), 1);
+
+        __m256i out = _mm256_or_si256(_mm256_slli_epi32(a, 24), _mm256_slli_epi32(c, 16));
+        out = _mm256_or_si256(out, _mm256_or_si256(_mm256_slli_epi32(c, 8), c));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), out);
+    }
+    disable_scalar(src + i, dst + i, count - i);
+}
+
+#endif
+
+//========================================[Dispatch]========================================
+
+#ifdef WGAC_PIXEL_KERNELS_X86
+const PixelKernels avx2Kernels = {
+    "avx2",
+    premultiply_avx2<false>,
+    premultiply_avx2<true>,
+    expand_rgb_avx2,
+    unpremultiply_avx2<false>,
+    unpremultiply_avx2<true>,
+    unpremultiply_rgb_avx2,
+    disable_avx2,
+};
+
+const PixelKernels sse2Kernels = {
+    "sse2",
+    premultiply_sse2<false>,
+    premultiply_sse2<true>,
+    expand_rgb_scalar,
+    unpremultiply_sse2<false>,
+    unpremultiply_sse2<true>,
+    unpremultiply_rgb_scalar,
+    disable_sse2,
+};
+#endif
+
+const PixelKernels scalarKernels = {
+    "scalar",
+    premultiply_scalar<false>,
+    premultiply_scalar<true>,
+    expand_rgb_scalar,
+    unpremultiply_scalar<false>,
+    unpremultiply_scalar<true>,
+    unpremultiply_rgb_scalar,
+    disable_scalar,
+};
+
+const PixelKernels& SelectPixelKernels()
+{
+#ifdef WGAC_PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return avx2Kernels;
+    if (__builtin_cpu_supports("sse2")) return sse2Kernels;
+#endif
+    return scalarKernels;
+}
+
+const PixelKernels& GetPixelKernels()
+{
+    static const PixelKernels& kernels = SelectPixelKernels();
+    return kernels;
+}
+
+}
+
+void PremultiplyRgba(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    GetPixelKernels().premultiplyRgba(src, dst, count);
+}
+
+void PremultiplyBgra(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    GetPixelKernels().premultiplyBgra(src, dst, count);
+}
+
+void ExpandRgb(const uint8_t* src, uint32_t* dst, size_t count)
+{
+    GetPixelKernels().expandRgb(src, dst, count);
+}
+
+void UnpremultiplyToRgba(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    GetPixelKernels().unpremultiplyToRgba(src, dst, count);
+}
+
+void UnpremultiplyToBgra(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    GetPixelKernels().unpremultiplyToBgra(src, dst, count);
+}
+
+void UnpremultiplyToRgb(const uint32_t* src, uint8_t* dst, size_t count)
+{
+    GetPixelKernels().unpremultiplyToRgb(src, dst, count);
+}
+
+void DisablePixels(const uint32_t* src, uint32_t* dst, size_t count)
+{
+    GetPixelKernels().disable(src, dst, count);
+}
+
+RgbaContent ClassifyRgba(const uint8_t* src, size_t count, uint32_t& color)
+{
+    bool opaque = true;
+    bool singleColor = true;
+    bool hasColor = false;
+    uint32_t first = 0;
+    for (size_t i = 0; i < count && (opaque || singleColor); i++) {
+        const uint8_t* pixel = src + i * 4;
+        if (pixel[3] != 255) opaque = false;
+        if (pixel[3] == 0) continue;
+        uint32_t rgb = ((uint32_t)pixel[0] << 16) | ((uint32_t)pixel[1] << 8) | pixel[2];
+        if (!hasColor) {
+            hasColor = true;
+            first = rgb;
+        } else if (rgb != first) {
+            singleColor = false;
+        }
+    }
+
+    if (opaque) return RgbaContent::Opaque;
+    if (singleColor) {
+        color = first;
+        return RgbaContent::SingleColor;
+    }
+    return RgbaContent::General;
+}
+
+void DownsampleBox(const uint8_t* src, int srcWidth, int srcHeight, int srcStride, uint8_t* dst, int dstWidth, int dstHeight, int dstStride)
+{
+    // Column ranges are the same for every row
+    std::vector<int> columnStart(dstWidth + 1);
+    for (int x = 0; x <= dstWidth; x++) {
+        columnStart[x] = (int)((int64_t)x * srcWidth / dstWidth);
+    }
+
+    std::vector<uint64_t> sums((size_t)dstWidth * 4);
+    for (int y = 0; y < dstHeight; y++) {
+        int rowStart = (int)((int64_t)y * srcHeight / dstHeight);
+        int rowEnd = (int)((int64_t)(y + 1) * srcHeight / dstHeight);
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (int sy = rowStart; sy < rowEnd; sy++) {
+            auto row = reinterpret_cast<const uint32_t*>(src + (size_t)sy * srcStride);
+            for (int x = 0; x < dstWidth; x++) {
+                uint64_t* sum = &sums[x * 4];
+                for (int sx = columnStart[x]; sx < columnStart[x + 1]; sx++) {
+                    uint32_t pixel = row[sx];
+                    sum[0] += pixel >> 24;
+                    sum[1] += (pixel >> 16) & 0xFF;
+                    sum[2] += (pixel >> 8) & 0xFF;
+                    sum[3] += pixel & 0xFF;
+                }
+            }
+        }
+
+        auto out = reinterpret_cast<uint32_t*>(dst + (size_t)y * dstStride);
+        for (int x = 0; x < dstWidth; x++) {
+            uint64_t count = (uint64_t)(columnStart[x + 1] - columnStart[x]) * (uint64_t)(rowEnd - rowStart);
+            const uint64_t* sum = &sums[x * 4];
+            uint64_t half = count / 2;
+            out[x] = (uint32_t)(((sum[0] + half) / count) << 24)
+                | (uint32_t)(((sum[1] + half) / count) << 16)
+                | (uint32_t)(((sum[2] + half) / count) << 8)
+                | (uint32_t)((sum[3] + half) / count);
+        }
+    }
+}
+
+const char* GetPixelKernelsName()
+{
+    return GetPixelKernels().name;
+}
+
+const PixelKernels* FindPixelKernels(const char* name)
+{
+#ifdef WGAC_PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") ? &avx2Kernels : nullptr;
+    }
+    if (strcmp(name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2") ? &sse2Kernels : nullptr;
+    }
+#endif
+    return strcmp(name, "scalar") == 0 ? &scalarKernels : nullptr;
+}
+
+}
+}
+}
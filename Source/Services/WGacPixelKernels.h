@@ -0,0 +1,69 @@
+#ifndef WGAC_PIXELKERNELS_H
+#define WGAC_PIXELKERNELS_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace vl {
+namespace presentation {
+namespace wayland {
+
+// Pixel loops over cairo ARGB32 data (native-endian 0xAARRGGBB, premultiplied alpha).
+// The best implementation (AVX2, SSE2 or scalar) is selected once at runtime.
+// Unless noted otherwise source and destination may be the same buffer.
+
+// Straight RGBA / BGRA bytes to premultiplied ARGB32
+extern void PremultiplyRgba(const uint8_t* src, uint32_t* dst, size_t count);
+extern void PremultiplyBgra(const uint8_t* src, uint32_t* dst, size_t count);
+// RGB bytes to opaque ARGB32, src and dst must not overlap
+extern void ExpandRgb(const uint8_t* src, uint32_t* dst, size_t count);
+
+// Premultiplied ARGB32 to straight RGBA / BGRA bytes
+extern void UnpremultiplyToRgba(const uint32_t* src, uint8_t* dst, size_t count);
+extern void UnpremultiplyToBgra(const uint32_t* src, uint8_t* dst, size_t count);
+// Premultiplied ARGB32 to straight RGB bytes, alpha is dropped
+extern void UnpremultiplyToRgb(const uint32_t* src, uint8_t* dst, size_t count);
+
+// Desaturate and fade towards white within each pixel's own coverage, used for disabled images
+extern void DisablePixels(const uint32_t* src, uint32_t* dst, size_t count);
+
+// What a straight RGBA buffer contains, used to pick the most compact surface format
+enum class RgbaContent
+{
+    Opaque,         // every alpha is 255
+    SingleColor,    // every visible pixel has the same colour, only the coverage varies
+    General,
+};
+
+// color receives 0xRRGGBB when the result is SingleColor
+extern RgbaContent ClassifyRgba(const uint8_t* src, size_t count, uint32_t& color);
+
+// Area-average downsampling of premultiplied ARGB32, each target pixel averages the source pixels it covers.
+// Strides are in bytes, the target must not be larger than the source in either direction.
+extern void DownsampleBox(const uint8_t* src, int srcWidth, int srcHeight, int srcStride, uint8_t* dst, int dstWidth, int dstHeight, int dstStride);
+
+// "avx2", "sse2" or "scalar"
+extern const char* GetPixelKernelsName();
+
+// One implementation of the dispatched kernels above
+struct PixelKernels
+{
+    const char* name;
+    void (*premultiplyRgba)(const uint8_t*, uint32_t*, size_t);
+    void (*premultiplyBgra)(const uint8_t*, uint32_t*, size_t);
+    void (*expandRgb)(const uint8_t*, uint32_t*, size_t);
+    void (*unpremultiplyToRgba)(const uint32_t*, uint8_t*, size_t);
+    void (*unpremultiplyToBgra)(const uint32_t*, uint8_t*, size_t);
+    void (*unpremultiplyToRgb)(const uint32_t*, uint8_t*, size_t);
+    void (*disable)(const uint32_t*, uint32_t*, size_t);
+};
+
+// The implementation called "avx2", "sse2" or "scalar", or nullptr if the CPU does not support it.
+// Lets benchmarks and tests run every path, the functions above always use the best one.
+extern const PixelKernels* FindPixelKernels(const char* name);
+
+}
+}
+}
+
+#endif // WGAC_PIXELKERNELS_H
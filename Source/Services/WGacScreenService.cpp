@@ -1,12 +1,14 @@
 #include "WGacScreenService.h"
 #include "../Wayland/WaylandDisplay.h"
+#include "../WGacNativeWindow.h"
 
 namespace vl {
 namespace presentation {
 namespace wayland {
 
-WGacScreen::WGacScreen(const NativeRect& _bounds, const WString& _name, bool _primary, double scale)
-    : bounds(_bounds)
+WGacScreen::WGacScreen(const NativeRect& _bounds, const WString& _name, bool _primary, double scale, wl_output* _output)
+    : output(_output)
+    , bounds(_bounds)
     , name(_name)
     , primary(_primary)
     , scalingX(scale)
@@ -14,6 +16,20 @@ WGacScreen::WGacScreen(const NativeRect& _bounds, const WString& _name, bool _pr
 {
 }
 
+wl_output* WGacScreen::GetOutput()
+{
+    return output;
+}
+
+void WGacScreen::Update(const NativeRect& _bounds, const WString& _name, bool _primary, double scale)
+{
+    bounds = _bounds;
+    name = _name;
+    primary = _primary;
+    scalingX = scale;
+    scalingY = scale;
+}
+
 double WGacScreen::GetScalingX()
 {
     return scalingX;
@@ -46,21 +62,74 @@ bool WGacScreen::IsPrimary()
 
 void WGacScreenService::RefreshScreenInformation()
 {
-    monitors.Clear();
-    // Get scale factor from Wayland display
-    double scale = 1.0;
+    collections::List<Ptr<WGacScreen>> updated;
     WaylandDisplay* display = GetWaylandDisplay();
-    if (display) {
-        scale = display->GetOutputScale();
+    if (display)
+    {
+        for (auto& state : display->GetOutputs())
+        {
+            // The size arrives with the current mode, until then the output is not a usable screen
+            if (state.width <= 0 || state.height <= 0)
+            {
+                continue;
+            }
+
+            // Window coordinates are logical, so is the reported size
+            int32_t width = state.width / state.scale;
+            int32_t height = state.height / state.scale;
+            if (state.transform == WL_OUTPUT_TRANSFORM_90 || state.transform == WL_OUTPUT_TRANSFORM_270
+                || state.transform == WL_OUTPUT_TRANSFORM_FLIPPED_90 || state.transform == WL_OUTPUT_TRANSFORM_FLIPPED_270)
+            {
+                std::swap(width, height);
+            }
+            NativeRect bounds(state.x, state.y, state.x + width, state.y + height);
+
+            WString name = atow(AString((state.make + " " + state.model).c_str()));
+            if (state.make.empty() && state.model.empty())
+            {
+                name = WString::Unmanaged(L"Monitor ") + itow(updated.Count() + 1);
+            }
+
+            bool primary = updated.Count() == 0;
+            Ptr<WGacScreen> screen;
+            for (vint i = 0; i < monitors.Count(); i++)
+            {
+                if (monitors[i]->GetOutput() == state.output)
+                {
+                    screen = monitors[i];
+                    break;
+                }
+            }
+            if (screen)
+            {
+                screen->Update(bounds, name, primary, state.scale);
+            }
+            else
+            {
+                screen = Ptr(new WGacScreen(bounds, name, primary, state.scale, state.output));
+            }
+            updated.Add(screen);
+        }
     }
-    // Add a default screen for now
-    // In a full implementation, this would query Wayland outputs
-    monitors.Add(Ptr(new WGacScreen(
-        NativeRect(0, 0, 1920, 1080),
-        L"Default Monitor",
-        true,
-        scale
-    )));
+
+    if (updated.Count() == 0)
+    {
+        // No output information, keep a single placeholder screen
+        if (monitors.Count() == 1 && !monitors[0]->GetOutput())
+        {
+            return;
+        }
+        updated.Add(Ptr(new WGacScreen(NativeRect(0, 0, 1920, 1080), L"Default Monitor", true)));
+    }
+
+    for (vint i = 0; i < monitors.Count(); i++)
+    {
+        if (!updated.Contains(monitors[i]))
+        {
+            retiredMonitors.Add(monitors[i]);
+        }
+    }
+    collections::CopyFrom(monitors, updated);
 }
 
 vint WGacScreenService::GetScreenCount()
@@ -79,7 +148,21 @@ INativeScreen* WGacScreenService::GetScreen(vint index)
 
 INativeScreen* WGacScreenService::GetScreen(INativeWindow* window)
 {
-    // Return primary screen for now
+    // Wayland does not expose window positions, the first output the surface entered is its screen
+    if (auto nativeWindow = dynamic_cast<WGacNativeWindow*>(window))
+    {
+        auto& outputs = nativeWindow->GetEnteredOutputs();
+        if (outputs.Count() > 0)
+        {
+            for (vint i = 0; i < monitors.Count(); i++)
+            {
+                if (monitors[i]->GetOutput() == outputs[0])
+                {
+                    return monitors[i].Obj();
+                }
+            }
+        }
+    }
     if (monitors.Count() > 0)
     {
         return monitors[0].Obj();
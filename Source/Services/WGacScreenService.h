@@ -2,6 +2,7 @@
 #define WGAC_SCREENSERVICE_H
 
 #include "GacUI.h"
+#include <wayland-client.h>
 
 namespace vl {
 namespace presentation {
@@ -10,6 +11,7 @@ namespace wayland {
 class WGacScreen : public Object, public INativeScreen
 {
 protected:
+    wl_output* output;
     NativeRect bounds;
     WString name;
     bool primary;
@@ -17,7 +19,10 @@ protected:
     double scalingY;
 
 public:
-    WGacScreen(const NativeRect& bounds, const WString& name, bool primary, double scale = 1.0);
+    WGacScreen(const NativeRect& bounds, const WString& name, bool primary, double scale = 1.0, wl_output* output = nullptr);
+
+    wl_output* GetOutput();
+    void Update(const NativeRect& bounds, const WString& name, bool primary, double scale);
 
     double GetScalingX() override;
     double GetScalingY() override;
@@ -31,8 +36,11 @@ class WGacScreenService : public Object, public INativeScreenService
 {
 protected:
     collections::List<Ptr<WGacScreen>> monitors;
+    // Screens whose output went away, GacUI may still hold pointers to them
+    collections::List<Ptr<WGacScreen>> retiredMonitors;
 
 public:
+    // Screens are updated in place so pointers handed out earlier stay valid, removed screens are never freed
     void RefreshScreenInformation();
     vint GetScreenCount() override;
     INativeScreen* GetScreen(vint index) override;
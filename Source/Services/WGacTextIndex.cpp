@@ -0,0 +1,483 @@
+#include "WGacTextIndex.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && __SIZEOF_WCHAR_T__ == 4
+#include <immintrin.h>
+#define WGAC_TEXT_KERNELS_X86
+#define WGAC_TARGET_SSE2 __attribute__((target("sse2")))
+#define WGAC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace vl {
+namespace presentation {
+namespace wayland {
+
+namespace {
+
+//========================================[Scalar]========================================
+
+inline bool is_ascii(wchar_t c)
+{
+    return (uint32_t)c < 0x80;
+}
+
+inline bool is_high_surrogate(uint32_t c)
+{
+    return c >= 0xD800 && c <= 0xDBFF;
+}
+
+inline bool is_low_surrogate(uint32_t c)
+{
+    return c >= 0xDC00 && c <= 0xDFFF;
+}
+
+// The code point starting at text[i], units receives the number of wchar_t it takes
+inline uint32_t read_code_point(const wchar_t* text, vint i, vint length, vint& units)
+{
+    uint32_t c = (uint32_t)text[i];
+    units = 1;
+    if (is_high_surrogate(c) && i + 1 < length && is_low_surrogate((uint32_t)text[i + 1])) {
+        units = 2;
+        return 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)text[i + 1] - 0xDC00);
+    }
+    return c > 0x10FFFF ? 0xFFFD : c;
+}
+
+// A lone surrogate is written as its own three bytes, so every wchar_t string round-trips through the index
+inline vint utf8_length_of(uint32_t c)
+{
+    if (c < 0x80) return 1;
+    if (c < 0x800) return 2;
+    if (c < 0x10000) return 3;
+    return 4;
+}
+
+inline vint write_code_point(uint32_t c, char* target)
+{
+    if (c < 0x80) {
+        target[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        target[0] = (char)(0xC0 | (c >> 6));
+        target[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        target[0] = (char)(0xE0 | (c >> 12));
+        target[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        target[2] = (char)(0x80 | (c & 0x3F));
+        return 3;
+    }
+    target[0] = (char)(0xF0 | (c >> 18));
+    target[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+    target[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+    target[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+}
+
+// Decodes one sequence from a non-ASCII lead byte, bytes receives its length.
+// Anything malformed, overlong or out of range consumes one byte and gives U+FFFD.
+inline uint32_t read_utf8(const unsigned char* utf8, vint i, vint length, vint& bytes)
+{
+    unsigned char c = utf8[i];
+    vint count = 0;
+    uint32_t value = 0;
+    uint32_t minimum = 0;
+    if ((c & 0xE0) == 0xC0) {
+        count = 2;
+        value = c & 0x1F;
+        minimum = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+        count = 3;
+        value = c & 0x0F;
+        minimum = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+        count = 4;
+        value = c & 0x07;
+        minimum = 0x10000;
+    }
+
+    bytes = 1;
+    if (count == 0 || i + count > length) return 0xFFFD;
+    for (vint k = 1; k < count; k++) {
+        if ((utf8[i + k] & 0xC0) != 0x80) return 0xFFFD;
+        value = (value << 6) | (utf8[i + k] & 0x3F);
+    }
+    if (value < minimum || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) return 0xFFFD;
+    bytes = count;
+    return value;
+}
+
+inline vint write_wchar(uint32_t c, wchar_t* target)
+{
+    if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+        target[0] = (wchar_t)(0xD800 + ((c - 0x10000) >> 10));
+        target[1] = (wchar_t)(0xDC00 + ((c - 0x10000) & 0x3FF));
+        return 2;
+    }
+    target[0] = (wchar_t)c;
+    return 1;
+}
+
+// Each kernel handles the ASCII prefix of its input and returns its length
+
+vint ascii_prefix_scalar(const wchar_t* text, vint length)
+{
+    vint i = 0;
+    while (i < length && is_ascii(text[i])) i++;
+    return i;
+}
+
+vint narrow_ascii_scalar(const wchar_t* text, char* target, vint length)
+{
+    vint i = 0;
+    for (; i < length && is_ascii(text[i]); i++) {
+        target[i] = (char)text[i];
+    }
+    return i;
+}
+
+vint widen_ascii_scalar(const char* utf8, wchar_t* target, vint length)
+{
+    vint i = 0;
+    for (; i < length && (unsigned char)utf8[i] < 0x80; i++) {
+        target[i] = (wchar_t)utf8[i];
+    }
+    return i;
+}
+
+#ifdef WGAC_TEXT_KERNELS_X86
+
+//========================================[SSE2]========================================
+
+WGAC_TARGET_SSE2 inline bool all_ascii_sse2(__m128i units)
+{
+    // wchar_t is signed, negative values have the high bits set as well
+    __m128i high = _mm_and_si128(units, _mm_set1_epi32(~0x7F));
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128())) == 0xFFFF;
+}
+
+WGAC_TARGET_SSE2 vint ascii_prefix_sse2(const wchar_t* text, vint length)
+{
+    vint i = 0;
+    for (; i + 16 <= length; i += 16) {
+        auto src = reinterpret_cast<const __m128i*>(text + i);
+        __m128i all = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(src), _mm_loadu_si128(src + 1)),
+            _mm_or_si128(_mm_loadu_si128(src + 2), _mm_loadu_si128(src + 3)));
+        if (!all_ascii_sse2(all)) break;
+    }
+    return i + ascii_prefix_scalar(text + i, length - i);
+}
+
+WGAC_TARGET_SSE2 vint narrow_ascii_sse2(const wchar_t* text, char* target, vint length)
+{
+    vint i = 0;
+    for (; i + 16 <= length; i += 16) {
+        auto src = reinterpret_cast<const __m128i*>(text + i);
+        __m128i a = _mm_loadu_si128(src);
+        __m128i b = _mm_loadu_si128(src + 1);
+        __m128i c = _mm_loadu_si128(src + 2);
+        __m128i d = _mm_loadu_si128(src + 3);
+        if (!all_ascii_sse2(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) break;
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), bytes);
+    }
+    return i + narrow_ascii_scalar(text + i, target + i, length - i);
+}
+
+WGAC_TARGET_SSE2 vint widen_ascii_sse2(const char* utf8, wchar_t* target, vint length)
+{
+    vint i = 0;
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf8 + i));
+        if (_mm_movemask_epi8(bytes) != 0) break;
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        auto dst = reinterpret_cast<__m128i*>(target + i);
+        _mm_storeu_si128(dst, _mm_unpacklo_epi16(low, zero));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(low, zero));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(high, zero));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(high, zero));
+    }
+    return i + widen_ascii_scalar(utf8 + i, target + i, length - i);
+}
+
+//========================================[AVX2]========================================
+
+WGAC_TARGET_AVX2 vint ascii_prefix_avx2(const wchar_t* text, vint length)
+{
+    vint i = 0;
+    __m256i mask = _mm256_set1_epi32(~0x7F);
+    for (; i + 32 <= length; i += 32) {
+        auto src = reinterpret_cast<const __m256i*>(text + i);
+        __m256i all = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(src), _mm256_loadu_si256(src + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(src + 2), _mm256_loadu_si256(src + 3)));
+        if (!_mm256_testz_si256(all, mask)) break;
+    }
+    return i + ascii_prefix_scalar(text + i, length - i);
+}
+
+WGAC_TARGET_AVX2 vint narrow_ascii_avx2(const wchar_t* text, char* target, vint length)
+{
+    vint i = 0;
+    __m256i mask = _mm256_set1_epi32(~0x7F);
+    // Packing works within 128 bit lanes, this puts the four dwords of each lane back in order
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (; i + 32 <= length; i += 32) {
+        auto src = reinterpret_cast<const __m256i*>(text + i);
+        __m256i a = _mm256_loadu_si256(src);
+        __m256i b = _mm256_loadu_si256(src + 1);
+        __m256i c = _mm256_loadu_si256(src + 2);
+        __m256i d = _mm256_loadu_si256(src + 3);
+        if (!_mm256_testz_si256(_mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d)), mask)) break;
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    return i + narrow_ascii_scalar(text + i, target + i, length - i);
+}
+
+WGAC_TARGET_AVX2 vint widen_ascii_avx2(const char* utf8, wchar_t* target, vint length)
+{
+    vint i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf8 + i));
+        if (_mm256_movemask_epi8(bytes) != 0) break;
+        auto dst = reinterpret_cast<__m256i*>(target + i);
+        for (vint k = 0; k < 4; k++) {
+            __m128i eight = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(utf8 + i + k * 8));
+            _mm256_storeu_si256(dst + k, _mm256_cvtepu8_epi32(eight));
+        }
+    }
+    return i + widen_ascii_scalar(utf8 + i, target + i, length - i);
+}
+
+#endif
+
+//========================================[Dispatch]========================================
+
+struct TextKernels
+{
+    const char* name;
+    vint (*asciiPrefix)(const wchar_t*, vint);
+    vint (*narrowAscii)(const wchar_t*, char*, vint);
+    vint (*widenAscii)(const char*, wchar_t*, vint);
+};
+
+TextKernels SelectTextKernels()
+{
+#ifdef WGAC_TEXT_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return { "avx2", ascii_prefix_avx2, narrow_ascii_avx2, widen_ascii_avx2 };
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return { "sse2", ascii_prefix_sse2, narrow_ascii_sse2, widen_ascii_sse2 };
+    }
+#endif
+    return { "scalar", ascii_prefix_scalar, narrow_ascii_scalar, widen_ascii_scalar };
+}
+
+const TextKernels& GetTextKernels()
+{
+    static const TextKernels kernels = SelectTextKernels();
+    return kernels;
+}
+
+}
+
+vint GetUtf8Length(const wchar_t* text, vint length)
+{
+    auto& kernels = GetTextKernels();
+    vint bytes = 0;
+    vint i = 0;
+    while (i < length) {
+        if (is_ascii(text[i])) {
+            vint ascii = kernels.asciiPrefix(text + i, length - i);
+            i += ascii;
+            bytes += ascii;
+        } else {
+            vint units;
+            bytes += utf8_length_of(read_code_point(text, i, length, units));
+            i += units;
+        }
+    }
+    return bytes;
+}
+
+vint EncodeUtf8(const wchar_t* text, vint length, char* target)
+{
+    auto& kernels = GetTextKernels();
+    vint bytes = 0;
+    vint i = 0;
+    while (i < length) {
+        if (is_ascii(text[i])) {
+            vint ascii = kernels.narrowAscii(text + i, target + bytes, length - i);
+            i += ascii;
+            bytes += ascii;
+        } else {
+            vint units;
+            bytes += write_code_point(read_code_point(text, i, length, units), target + bytes);
+            i += units;
+        }
+    }
+    return bytes;
+}
+
+AString EncodeUtf8(const WString& text)
+{
+    if (text.Length() == 0) return AString();
+    vint length = GetUtf8Length(text.Buffer(), text.Length());
+    auto buffer = new char[length + 1];
+    EncodeUtf8(text.Buffer(), text.Length(), buffer);
+    buffer[length] = 0;
+    return AString::TakeOver(buffer, length);
+}
+
+WString DecodeUtf8(const char* utf8, vint length)
+{
+    if (length == 0) return WString();
+    auto& kernels = GetTextKernels();
+    auto bytes = reinterpret_cast<const unsigned char*>(utf8);
+    // Never more characters than bytes
+    auto buffer = new wchar_t[length + 1];
+    vint units = 0;
+    vint i = 0;
+    while (i < length) {
+        if (bytes[i] < 0x80) {
+            vint ascii = kernels.widenAscii(utf8 + i, buffer + units, length - i);
+            i += ascii;
+            units += ascii;
+        } else {
+            vint count;
+            units += write_wchar(read_utf8(bytes, i, length, count), buffer + units);
+            i += count;
+        }
+    }
+    buffer[units] = 0;
+    return WString::TakeOver(buffer, units);
+}
+
+const char* GetTextKernelsName()
+{
+    return GetTextKernels().name;
+}
+
+/***********************************************************************
+WGacTextIndex
+***********************************************************************/
+
+WGacTextIndex::WGacTextIndex()
+{
+}
+
+void WGacTextIndex::SetText(const WString& value)
+{
+    text = value;
+    utf8 = EncodeUtf8(text);
+    if (utf8.Length() == text.Length()) {
+        checkpoints.Resize(0);
+        return;
+    }
+
+    // Walk the text once, stepping over ASCII runs and recording every checkpoint they cover
+    auto& kernels = GetTextKernels();
+    const wchar_t* buffer = text.Buffer();
+    vint length = text.Length();
+    checkpoints.Resize(length / CheckpointInterval + 1);
+    vint next = 0;
+    vint bytes = 0;
+    vint i = 0;
+    while (i < length) {
+        vint ascii = is_ascii(buffer[i]) ? kernels.asciiPrefix(buffer + i, length - i) : 0;
+        for (; next * CheckpointInterval < i + ascii; next++) {
+            checkpoints[next] = bytes + (next * CheckpointInterval - i);
+        }
+        i += ascii;
+        bytes += ascii;
+        if (i == length) break;
+
+        vint units;
+        vint count = utf8_length_of(read_code_point(buffer, i, length, units));
+        // A checkpoint inside a surrogate pair points to the start of the pair
+        for (; next * CheckpointInterval < i + units; next++) {
+            checkpoints[next] = bytes;
+        }
+        i += units;
+        bytes += count;
+    }
+    for (; next < checkpoints.Count(); next++) {
+        checkpoints[next] = bytes;
+    }
+}
+
+const WString& WGacTextIndex::GetText() const
+{
+    return text;
+}
+
+const AString& WGacTextIndex::GetUtf8() const
+{
+    return utf8;
+}
+
+vint WGacTextIndex::ScanStart(vint checkpoint, vint& byteOffset) const
+{
+    vint i = checkpoint * CheckpointInterval;
+    byteOffset = checkpoints[checkpoint];
+    if (i > 0 && i < text.Length() && is_low_surrogate((uint32_t)text[i]) && is_high_surrogate((uint32_t)text[i - 1])) {
+        i--;
+    }
+    return i;
+}
+
+vint WGacTextIndex::CharToByte(vint charPos) const
+{
+    if (charPos <= 0) return 0;
+    if (charPos >= text.Length()) return utf8.Length();
+    if (checkpoints.Count() == 0) return charPos;
+
+    vint bytes;
+    vint i = ScanStart(charPos / CheckpointInterval, bytes);
+    while (i < charPos) {
+        vint units;
+        vint count = utf8_length_of(read_code_point(text.Buffer(), i, text.Length(), units));
+        if (i + units > charPos) break;
+        i += units;
+        bytes += count;
+    }
+    return bytes;
+}
+
+vint WGacTextIndex::ByteToChar(vint bytePos) const
+{
+    if (bytePos <= 0) return 0;
+    if (bytePos >= utf8.Length()) return text.Length();
+    if (checkpoints.Count() == 0) return bytePos;
+
+    // The last checkpoint at or before the byte
+    vint low = 0;
+    vint high = checkpoints.Count() - 1;
+    while (low < high) {
+        vint middle = (low + high + 1) / 2;
+        if (checkpoints[middle] <= bytePos) low = middle;
+        else high = middle - 1;
+    }
+
+    vint bytes;
+    vint i = ScanStart(low, bytes);
+    while (i < text.Length()) {
+        vint units;
+        vint count = utf8_length_of(read_code_point(text.Buffer(), i, text.Length(), units));
+        if (bytes + count > bytePos) break;
+        i += units;
+        bytes += count;
+    }
+    return i;
+}
+
+}
+}
+}
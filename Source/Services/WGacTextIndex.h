@@ -0,0 +1,56 @@
+#ifndef WGAC_TEXTINDEX_H
+#define WGAC_TEXTINDEX_H
+
+#include "GacUI.h"
+
+namespace vl {
+namespace presentation {
+namespace wayland {
+
+// Conversion between wchar_t text and UTF-8. Runs of ASCII are copied with SSE2 or AVX2,
+// selected once at runtime. Surrogate pairs are combined, invalid UTF-8 bytes decode to U+FFFD.
+
+// Number of UTF-8 bytes needed to encode the text
+extern vint GetUtf8Length(const wchar_t* text, vint length);
+// target must hold GetUtf8Length(text, length) bytes, returns the number of bytes written
+extern vint EncodeUtf8(const wchar_t* text, vint length, char* target);
+extern AString EncodeUtf8(const WString& text);
+extern WString DecodeUtf8(const char* utf8, vint length);
+
+// "avx2", "sse2" or "scalar"
+extern const char* GetTextKernelsName();
+
+// A wchar_t string together with its UTF-8 encoding, mapping positions between the two.
+// Byte offsets are recorded every CheckpointInterval characters, a lookup starts from the nearest
+// checkpoint: character to byte is constant time, byte to character is a binary search.
+// ASCII text keeps no checkpoints, positions are the same in both encodings.
+class WGacTextIndex
+{
+public:
+    static const vint CheckpointInterval = 64;
+
+protected:
+    WString text;
+    AString utf8;
+    collections::Array<vint> checkpoints;   // byte offset of character k * CheckpointInterval
+
+    vint ScanStart(vint checkpoint, vint& byteOffset) const;
+
+public:
+    WGacTextIndex();
+
+    void SetText(const WString& value);
+    const WString& GetText() const;
+    const AString& GetUtf8() const;
+
+    // Both are clamped to the text. A position inside a surrogate pair maps to the start of the pair,
+    // a byte inside a character maps to that character.
+    vint CharToByte(vint charPos) const;
+    vint ByteToChar(vint bytePos) const;
+};
+
+}
+}
+}
+
+#endif // WGAC_TEXTINDEX_H
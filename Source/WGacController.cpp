@@ -51,6 +51,9 @@ public:
         SetWaylandDisplay(display);
         clipboardService.Initialize();
         screenService.RefreshScreenInformation();
+        if (display) {
+            display->SetOutputsChangedCallback([this]() { screenService.RefreshScreenInformation(); });
+        }
     }
 
     ~WGacController()
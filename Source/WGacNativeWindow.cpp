@@ -1,5 +1,6 @@
 #include "WGacNativeWindow.h"
 #include "WGacGacView.h"
+#include "Services/WGacTextIndex.h"
 #include <cstring>
 
 namespace vl {
@@ -30,6 +31,15 @@ namespace {
     const wl_callback_listener popup_sync_listener = {
         .done = WGacNativeWindow::popup_sync_done,
     };
+
+    const wl_surface_listener surface_listener = {
+        .enter = WGacNativeWindow::surface_enter,
+        .leave = WGacNativeWindow::surface_leave,
+    };
+
+    const wp_fractional_scale_v1_listener fractional_scale_listener = {
+        .preferred_scale = WGacNativeWindow::fractional_scale_preferred_scale,
+    };
 }
 
 WGacNativeWindow::WGacNativeWindow(WaylandDisplay* _display, INativeWindow::WindowMode _mode)
@@ -39,6 +49,8 @@ WGacNativeWindow::WGacNativeWindow(WaylandDisplay* _display, INativeWindow::Wind
     , toplevel(nullptr)
     , popup(nullptr)
     , decoration(nullptr)
+    , viewport(nullptr)
+    , fractionalScale(nullptr)
     , frameCallback(nullptr)
     , popupSyncCallback(nullptr)
     , bufferPool(nullptr)
@@ -54,6 +66,9 @@ WGacNativeWindow::WGacNativeWindow(WaylandDisplay* _display, INativeWindow::Wind
     , posX(0)
     , posY(0)
     , currentBufferScale(1)
+    , outputScale(1)
+    , preferredScale(0)
+    , renderScale(1.0)
     , configured(false)
     , visible(false)
     , closed(false)
@@ -87,6 +102,10 @@ bool WGacNativeWindow::Create()
 
     surface = wl_compositor_create_surface(display->GetCompositor());
     if (!surface) return false;
+    wl_surface_add_listener(surface, &surface_listener, this);
+
+    // Until the surface enters an output, assume it is on the primary one
+    outputScale = display->GetOutputScale();
 
     // For popup/tooltip/menu windows, delay xdg_surface creation until Show()
     // because we need parent and position information first
@@ -101,21 +120,19 @@ bool WGacNativeWindow::Create()
         }
     }
 
-    // Get scale factor from display
-    int32_t scale = display->GetOutputScale();
-    if (scale < 1) scale = 1;
-    currentBufferScale = scale;
+    if (display->GetViewporter() && display->GetFractionalScaleManager()) {
+        viewport = wp_viewporter_get_viewport(display->GetViewporter(), surface);
+        fractionalScale = wp_fractional_scale_manager_v1_get_fractional_scale(display->GetFractionalScaleManager(), surface);
+        wp_fractional_scale_v1_add_listener(fractionalScale, &fractional_scale_listener, this);
+    }
 
     bufferPool = new WaylandBufferPool(display->GetShm());
     // Create buffer at scaled size
-    if (!bufferPool->Resize(currentWidth * scale, currentHeight * scale)) {
+    if (!UpdateBufferSize()) {
         Destroy();
         return false;
     }
 
-    // Set buffer scale on surface
-    wl_surface_set_buffer_scale(surface, scale);
-
     view = new WGacView(this, bufferPool);
     display->RegisterWindow(this);
 
@@ -127,6 +144,33 @@ bool WGacNativeWindow::Create()
     return true;
 }
 
+bool WGacNativeWindow::UpdateBufferSize()
+{
+    if (!bufferPool) return false;
+
+    // Without a preferred fractional scale, render at the integer output scale and let the compositor downsample
+    int32_t bufferScale = 1;
+    if (viewport && preferredScale > 0) {
+        renderScale = preferredScale / 120.0;
+    } else {
+        bufferScale = outputScale < 1 ? 1 : outputScale;
+        renderScale = bufferScale;
+    }
+
+    if (currentBufferScale != bufferScale) {
+        currentBufferScale = bufferScale;
+        wl_surface_set_buffer_scale(surface, bufferScale);
+    }
+    if (viewport && currentWidth > 0 && currentHeight > 0) {
+        wp_viewport_set_destination(viewport, currentWidth, currentHeight);
+    }
+
+    // Toplevel buffer sizes are rounded halfway away from zero, see wp_fractional_scale_v1
+    uint32_t width = static_cast<uint32_t>(currentWidth * renderScale + 0.5);
+    uint32_t height = static_cast<uint32_t>(currentHeight * renderScale + 0.5);
+    return bufferPool->Resize(width, height);
+}
+
 bool WGacNativeWindow::CreateXdgSurface()
 {
     if (xdgSurface) return true;  // Already created
@@ -246,6 +290,18 @@ void WGacNativeWindow::Destroy()
     delete bufferPool;
     bufferPool = nullptr;
 
+    if (fractionalScale) {
+        wp_fractional_scale_v1_destroy(fractionalScale);
+        fractionalScale = nullptr;
+    }
+
+    if (viewport) {
+        wp_viewport_destroy(viewport);
+        viewport = nullptr;
+    }
+    preferredScale = 0;
+    enteredOutputs.Clear();
+
     if (decoration) {
         zxdg_toplevel_decoration_v1_destroy(decoration);
         decoration = nullptr;
@@ -311,20 +367,10 @@ void WGacNativeWindow::xdg_surface_configure(void* data, xdg_surface* xdg_surfac
     self->configured = true;
 
     if (self->currentWidth > 0 && self->currentHeight > 0) {
-        // Get scale factor for buffer sizing
-        int32_t scale = self->display->GetOutputScale();
-        if (scale < 1) scale = 1;
-        int32_t scaledWidth = self->currentWidth * scale;
-        int32_t scaledHeight = self->currentHeight * scale;
-
-        if (self->bufferPool->GetWidth() != static_cast<uint32_t>(scaledWidth) ||
-            self->bufferPool->GetHeight() != static_cast<uint32_t>(scaledHeight)) {
-            self->bufferPool->Resize(scaledWidth, scaledHeight);
-            // Only update buffer scale if it actually changed to avoid configure loops
-            if (self->currentBufferScale != scale) {
-                self->currentBufferScale = scale;
-                wl_surface_set_buffer_scale(self->surface, scale);
-            }
+        uint32_t oldWidth = self->bufferPool->GetWidth();
+        uint32_t oldHeight = self->bufferPool->GetHeight();
+        self->UpdateBufferSize();
+        if (self->bufferPool->GetWidth() != oldWidth || self->bufferPool->GetHeight() != oldHeight) {
             for (vint i = 0; i < self->listeners.Count(); i++) {
                 self->listeners[i]->Moved();
             }
@@ -486,6 +532,65 @@ void WGacNativeWindow::frame_done(void* data, wl_callback* callback, uint32_t /*
     self->OnFrame();
 }
 
+void WGacNativeWindow::UpdateOutputScale()
+{
+    int32_t scale = 0;
+    for (vint i = 0; i < enteredOutputs.Count(); i++) {
+        if (auto output = display->FindOutput(enteredOutputs[i])) {
+            if (output->scale > scale) scale = output->scale;
+        }
+    }
+    if (scale == 0) scale = display->GetOutputScale();
+    if (scale == outputScale) return;
+    outputScale = scale;
+
+    // The fractional scale takes precedence once the compositor has sent one
+    if (!bufferPool || (viewport && preferredScale > 0)) return;
+    UpdateBufferSize();
+    for (vint i = 0; i < listeners.Count(); i++) {
+        listeners[i]->Moved();
+    }
+}
+
+void WGacNativeWindow::surface_enter(void* data, wl_surface* /*surface*/, wl_output* output)
+{
+    auto* self = static_cast<WGacNativeWindow*>(data);
+    if (!self->enteredOutputs.Contains(output)) {
+        self->enteredOutputs.Add(output);
+        self->UpdateOutputScale();
+    }
+}
+
+void WGacNativeWindow::surface_leave(void* data, wl_surface* /*surface*/, wl_output* output)
+{
+    auto* self = static_cast<WGacNativeWindow*>(data);
+    if (self->enteredOutputs.Remove(output)) {
+        self->UpdateOutputScale();
+    }
+}
+
+void WGacNativeWindow::OnOutputChanged(wl_output* output)
+{
+    // Outputs removed by the compositor may not be followed by a leave event
+    if (!display->FindOutput(output)) {
+        enteredOutputs.Remove(output);
+    }
+    UpdateOutputScale();
+}
+
+void WGacNativeWindow::fractional_scale_preferred_scale(void* data, wp_fractional_scale_v1* /*fractional_scale*/, uint32_t scale)
+{
+    auto* self = static_cast<WGacNativeWindow*>(data);
+    if (scale == 0 || scale == self->preferredScale) return;
+    self->preferredScale = scale;
+
+    // The new buffer size and viewport destination are applied with the next commit
+    self->UpdateBufferSize();
+    for (vint i = 0; i < self->listeners.Count(); i++) {
+        self->listeners[i]->Moved();
+    }
+}
+
 void WGacNativeWindow::RequestFrame()
 {
     if (pendingFrame || !surface) return;
@@ -547,11 +652,7 @@ void WGacNativeWindow::SetBounds(const NativeRect& bounds) {
     if (newWidth != currentWidth || newHeight != currentHeight) {
         currentWidth = newWidth;
         currentHeight = newHeight;
-        if (bufferPool) {
-            int32_t scale = display->GetOutputScale();
-            if (scale < 1) scale = 1;
-            bufferPool->Resize(currentWidth * scale, currentHeight * scale);
-        }
+        UpdateBufferSize();
     }
     for (vint i = 0; i < listeners.Count(); i++) { listeners[i]->Moved(); }
 }
@@ -564,7 +665,7 @@ NativeSize WGacNativeWindow::GetClientSize() {
 void WGacNativeWindow::SetClientSize(NativeSize size) {
     currentWidth = size.x.value;
     currentHeight = size.y.value;
-    if (bufferPool) bufferPool->Resize(currentWidth, currentHeight);
+    UpdateBufferSize();
     for (vint i = 0; i < listeners.Count(); i++) { listeners[i]->Moved(); }
 }
 NativeRect WGacNativeWindow::GetClientBoundsInScreen() {
@@ -986,49 +1087,12 @@ static VKEY KeysymToVKey(uint32_t keysym) {
     }
 }
 
-// Convert UTF-8 string to wchar_t characters and call Char() for each
-static void SendUtf8AsChars(INativeWindowListener* listener, const std::string& utf8,
-                            bool ctrl, bool shift, bool alt, bool capslock) {
-    const unsigned char* p = reinterpret_cast<const unsigned char*>(utf8.c_str());
-    const unsigned char* end = p + utf8.size();
-
-    while (p < end) {
-        wchar_t codepoint = 0;
-        unsigned char c = *p;
-
-        if ((c & 0x80) == 0) {
-            // ASCII (1 byte)
-            codepoint = c;
-            p += 1;
-        } else if ((c & 0xE0) == 0xC0) {
-            // 2-byte sequence
-            if (p + 1 < end) {
-                codepoint = ((c & 0x1F) << 6) | (p[1] & 0x3F);
-                p += 2;
-            } else break;
-        } else if ((c & 0xF0) == 0xE0) {
-            // 3-byte sequence
-            if (p + 2 < end) {
-                codepoint = ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
-                p += 3;
-            } else break;
-        } else if ((c & 0xF8) == 0xF0) {
-            // 4-byte sequence (surrogate pairs needed for wchar_t if sizeof(wchar_t)==2)
-            if (p + 3 < end) {
-                uint32_t cp = ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
-                              ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
-                p += 4;
-                // On Linux wchar_t is typically 32-bit, so we can store directly
-                codepoint = static_cast<wchar_t>(cp);
-            } else break;
-        } else {
-            // Invalid UTF-8, skip byte
-            p += 1;
-            continue;
-        }
-
+// Call Char() for each character of text already decoded from UTF-8
+static void SendChars(INativeWindowListener* listener, const WString& text,
+                      bool ctrl, bool shift, bool alt, bool capslock) {
+    for (vint i = 0; i < text.Length(); i++) {
         NativeWindowCharInfo charInfo;
-        charInfo.code = codepoint;
+        charInfo.code = text[i];
         charInfo.ctrl = ctrl;
         charInfo.shift = shift;
         charInfo.alt = alt;
@@ -1045,13 +1109,16 @@ void WGacNativeWindow::OnKeyEvent(const KeyEventInfo& info) {
     nativeInfo.alt = info.alt;
     nativeInfo.capslock = info.capsLock;
 
+    // Send character events for printable text
+    WString text;
+    if (info.state == KeyState::Pressed && !info.text.empty() && !info.ctrl && !info.alt) {
+        text = DecodeUtf8(info.text.data(), (vint)info.text.size());
+    }
+
     for (auto listener : listeners) {
         if (info.state == KeyState::Pressed) {
             listener->KeyDown(nativeInfo);
-            // Send character events for printable text
-            if (!info.text.empty() && !info.ctrl && !info.alt) {
-                SendUtf8AsChars(listener, info.text, info.ctrl, info.shift, info.alt, info.capsLock);
-            }
+            SendChars(listener, text, info.ctrl, info.shift, info.alt, info.capsLock);
         } else if (info.state == KeyState::Released) {
             listener->KeyUp(nativeInfo);
         }
@@ -1090,9 +1157,10 @@ void WGacNativeWindow::OnTextInputPreedit(const PreeditInfo& info) {
 }
 
 void WGacNativeWindow::OnTextInputCommit(const std::string& text) {
-    // Convert UTF-8 to wchar_t and send as character events
+    // Decoded once and sent as character events to every listener
+    WString chars = DecodeUtf8(text.data(), (vint)text.size());
     for (auto listener : listeners) {
-        SendUtf8AsChars(listener, text, false, false, false, false);
+        SendChars(listener, chars, false, false, false, false);
     }
 }
 
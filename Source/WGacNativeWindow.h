@@ -26,6 +26,9 @@ protected:
     xdg_toplevel* toplevel;
     xdg_popup* popup;
     zxdg_toplevel_decoration_v1* decoration;
+    // Only created when the compositor supports both, buffers are then sized at the fractional scale
+    wp_viewport* viewport;
+    wp_fractional_scale_v1* fractionalScale;
     wl_callback* frameCallback;
     wl_callback* popupSyncCallback;
 
@@ -46,6 +49,12 @@ protected:
     int32_t posX;
     int32_t posY;
     int32_t currentBufferScale;
+    // Outputs the surface is on, the integer scale is the largest of theirs
+    collections::List<wl_output*> enteredOutputs;
+    int32_t outputScale;
+    // Preferred scale in 120ths from wp_fractional_scale_v1, 0 before the compositor sends one
+    uint32_t preferredScale;
+    double renderScale;
 
     bool configured;
     bool visible;
@@ -72,6 +81,10 @@ protected:
     void RequestFrame();
     void OnFrame();
     bool CreateXdgSurface();
+    // Sizes the buffer pool for the current logical size and scale
+    bool UpdateBufferSize();
+    // Recomputes the output scale and resizes the buffer only when it changed
+    void UpdateOutputScale();
 
 public:
     // Wayland callbacks
@@ -88,6 +101,9 @@ public:
     static void xdg_popup_done(void* data, xdg_popup* popup);
     static void frame_done(void* data, wl_callback* callback, uint32_t time);
     static void popup_sync_done(void* data, wl_callback* callback, uint32_t time);
+    static void surface_enter(void* data, wl_surface* surface, wl_output* output);
+    static void surface_leave(void* data, wl_surface* surface, wl_output* output);
+    static void fractional_scale_preferred_scale(void* data, wp_fractional_scale_v1* fractional_scale, uint32_t scale);
 
 public:
     WGacNativeWindow(WaylandDisplay* display, INativeWindow::WindowMode mode);
@@ -102,6 +118,9 @@ public:
     void SetGraphicsHandler(Interface* handler);
     Interface* GetGraphicsHandler() const;
     void CommitBuffer();
+    // Device pixels per logical pixel, may be fractional
+    double GetRenderScale() const { return renderScale; }
+    const collections::List<wl_output*>& GetEnteredOutputs() const { return enteredOutputs; }
 
     // INativeWindow implementation
     bool IsActivelyRefreshing() override;
@@ -198,6 +217,8 @@ public:
     // IME event handlers
     void OnTextInputPreedit(const PreeditInfo& info) override;
     void OnTextInputCommit(const std::string& text) override;
+
+    void OnOutputChanged(wl_output* output) override;
 };
 
 }
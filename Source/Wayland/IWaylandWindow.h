@@ -33,6 +33,9 @@ public:
     // IME event handlers
     virtual void OnTextInputPreedit(const PreeditInfo& info) = 0;
     virtual void OnTextInputCommit(const std::string& text) = 0;
+
+    // An output was updated or removed, windows that track the outputs they are on override this
+    virtual void OnOutputChanged(wl_output* /*output*/) {}
 };
 
 } // namespace wayland
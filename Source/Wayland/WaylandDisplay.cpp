@@ -99,6 +99,16 @@ void WaylandDisplay::Disconnect() {
         data_device_manager = nullptr;
     }
 
+    if (fractional_scale_manager) {
+        wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+        fractional_scale_manager = nullptr;
+    }
+
+    if (viewporter) {
+        wp_viewporter_destroy(viewporter);
+        viewporter = nullptr;
+    }
+
     if (text_input_manager) {
         zwp_text_input_manager_v3_destroy(text_input_manager);
         text_input_manager = nullptr;
@@ -124,6 +134,11 @@ void WaylandDisplay::Disconnect() {
         seat = nullptr;
     }
 
+    for (auto& state : outputs) {
+        wl_output_release(state.output);
+    }
+    outputs.clear();
+
     if (shm) {
         wl_shm_destroy(shm);
         shm = nullptr;
@@ -310,6 +325,14 @@ void WaylandDisplay::registry_global(void* data, wl_registry* registry,
         self->text_input_manager = static_cast<zwp_text_input_manager_v3*>(
             wl_registry_bind(registry, name, &zwp_text_input_manager_v3_interface, 1));
     }
+    else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+        self->viewporter = static_cast<wp_viewporter*>(
+            wl_registry_bind(registry, name, &wp_viewporter_interface, 1));
+    }
+    else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+        self->fractional_scale_manager = static_cast<wp_fractional_scale_manager_v1*>(
+            wl_registry_bind(registry, name, &wp_fractional_scale_manager_v1_interface, 1));
+    }
     else if (strcmp(interface, wl_data_device_manager_interface.name) == 0) {
         self->data_device_manager = static_cast<wl_data_device_manager*>(
             wl_registry_bind(registry, name, &wl_data_device_manager_interface, 3));
@@ -322,10 +345,10 @@ void WaylandDisplay::registry_global(void* data, wl_registry* registry,
     else if (strcmp(interface, wl_output_interface.name) == 0) {
         auto* output = static_cast<wl_output*>(
             wl_registry_bind(registry, name, &wl_output_interface, 3));
-        // Use first output as primary for scale factor
-        if (!self->primary_output) {
-            self->primary_output = output;
-        }
+        WaylandOutput state;
+        state.output = output;
+        state.name = name;
+        self->outputs.push_back(state);
         wl_output_add_listener(output, &output_listener, self);
         if (self->output_added_callback) {
             self->output_added_callback(output, name);
@@ -335,6 +358,16 @@ void WaylandDisplay::registry_global(void* data, wl_registry* registry,
 
 void WaylandDisplay::registry_global_remove(void* data, wl_registry* /*registry*/, uint32_t name) {
     auto* self = static_cast<WaylandDisplay*>(data);
+    for (auto it = self->outputs.begin(); it != self->outputs.end(); ++it) {
+        if (it->name == name) {
+            wl_output* output = it->output;
+            self->outputs.erase(it);
+            // Windows drop outputs that are no longer known
+            self->NotifyOutputChanged(output);
+            wl_output_release(output);
+            break;
+        }
+    }
     if (self->output_removed_callback) {
         self->output_removed_callback(name);
     }
@@ -369,26 +402,75 @@ IWaylandWindow* WaylandDisplay::FindWindowBySurface(wl_surface* surface) {
     return nullptr;
 }
 
-void WaylandDisplay::output_geometry(void* /*data*/, wl_output* /*output*/, int32_t /*x*/, int32_t /*y*/,
+WaylandOutput* WaylandDisplay::FindOutputState(wl_output* output) {
+    for (auto& state : outputs) {
+        if (state.output == output) {
+            return &state;
+        }
+    }
+    return nullptr;
+}
+
+const WaylandOutput* WaylandDisplay::FindOutput(wl_output* output) const {
+    for (auto& state : outputs) {
+        if (state.output == output) {
+            return &state;
+        }
+    }
+    return nullptr;
+}
+
+int32_t WaylandDisplay::GetOutputScale() const {
+    return outputs.empty() ? 1 : outputs.front().scale;
+}
+
+void WaylandDisplay::NotifyOutputChanged(wl_output* output) {
+    // Collect first, a window may resize and commit while being notified
+    std::vector<IWaylandWindow*> windows;
+    for (auto& pair : surface_to_window) {
+        windows.push_back(pair.second);
+    }
+    for (auto* window : windows) {
+        window->OnOutputChanged(output);
+    }
+    if (outputs_changed_callback) {
+        outputs_changed_callback();
+    }
+}
+
+void WaylandDisplay::output_geometry(void* data, wl_output* output, int32_t x, int32_t y,
                                       int32_t /*physical_width*/, int32_t /*physical_height*/,
-                                      int32_t /*subpixel*/, const char* /*make*/, const char* /*model*/, int32_t /*transform*/) {
-    // We don't need geometry info for now
+                                      int32_t /*subpixel*/, const char* make, const char* model, int32_t transform) {
+    auto* self = static_cast<WaylandDisplay*>(data);
+    if (auto* state = self->FindOutputState(output)) {
+        state->x = x;
+        state->y = y;
+        state->transform = transform;
+        state->make = make ? make : "";
+        state->model = model ? model : "";
+    }
 }
 
-void WaylandDisplay::output_mode(void* /*data*/, wl_output* /*output*/, uint32_t /*flags*/,
-                                  int32_t /*width*/, int32_t /*height*/, int32_t /*refresh*/) {
-    // We don't need mode info for now
+void WaylandDisplay::output_mode(void* data, wl_output* output, uint32_t flags,
+                                  int32_t width, int32_t height, int32_t /*refresh*/) {
+    auto* self = static_cast<WaylandDisplay*>(data);
+    if (!(flags & WL_OUTPUT_MODE_CURRENT)) return;
+    if (auto* state = self->FindOutputState(output)) {
+        state->width = width;
+        state->height = height;
+    }
 }
 
-void WaylandDisplay::output_done(void* /*data*/, wl_output* /*output*/) {
-    // Output info complete
+void WaylandDisplay::output_done(void* data, wl_output* output) {
+    auto* self = static_cast<WaylandDisplay*>(data);
+    // Properties are applied atomically, windows on this output recompute their scale now
+    self->NotifyOutputChanged(output);
 }
 
 void WaylandDisplay::output_scale(void* data, wl_output* output, int32_t factor) {
     auto* self = static_cast<WaylandDisplay*>(data);
-    // Use scale from primary output
-    if (output == self->primary_output) {
-        self->scale_factor = factor;
+    if (auto* state = self->FindOutputState(output)) {
+        state->scale = factor < 1 ? 1 : factor;
     }
 }
 
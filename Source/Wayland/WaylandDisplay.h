@@ -5,6 +5,8 @@
 #include "../Protocol/xdg-shell-client-protocol.h"
 #include "../Protocol/xdg-decoration-unstable-v1-client-protocol.h"
 #include "../Protocol/text-input-unstable-v3-client-protocol.h"
+#include "../Protocol/viewporter-client-protocol.h"
+#include "../Protocol/fractional-scale-v1-client-protocol.h"
 #include <functional>
 #include <vector>
 #include <unordered_map>
@@ -19,11 +21,26 @@ class WGacNativeWindow;
 class WaylandSeat;
 class IWaylandWindow;
 
+// What the compositor reported about a wl_output, the mode size is in output pixels
+struct WaylandOutput {
+    wl_output* output = nullptr;
+    uint32_t name = 0;
+    int32_t x = 0;
+    int32_t y = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t scale = 1;
+    int32_t transform = WL_OUTPUT_TRANSFORM_NORMAL;
+    std::string make;
+    std::string model;
+};
+
 class WaylandDisplay {
 public:
     using OutputAddedCallback = std::function<void(wl_output*, uint32_t name)>;
     using OutputRemovedCallback = std::function<void(uint32_t name)>;
     using SeatAddedCallback = std::function<void(wl_seat*, uint32_t name)>;
+    using OutputsChangedCallback = std::function<void()>;
 
 private:
     wl_display* display = nullptr;
@@ -36,6 +53,8 @@ private:
     zwp_text_input_manager_v3* text_input_manager = nullptr;
     wl_data_device_manager* data_device_manager = nullptr;
     wl_data_device* data_device = nullptr;
+    wp_viewporter* viewporter = nullptr;
+    wp_fractional_scale_manager_v1* fractional_scale_manager = nullptr;
 
     int display_fd = -1;
     bool running = false;
@@ -43,13 +62,16 @@ private:
 
     std::vector<uint32_t> shm_formats;
 
-    // Output scale factor (for HiDPI)
-    int32_t scale_factor = 1;
-    wl_output* primary_output = nullptr;
+    // Outputs in the order they were announced, the first one is treated as primary
+    std::vector<WaylandOutput> outputs;
 
     OutputAddedCallback output_added_callback;
     OutputRemovedCallback output_removed_callback;
     SeatAddedCallback seat_added_callback;
+    OutputsChangedCallback outputs_changed_callback;
+
+    WaylandOutput* FindOutputState(wl_output* output);
+    void NotifyOutputChanged(wl_output* output);
 
     // Window tracking for input event routing
     std::unordered_map<wl_surface*, IWaylandWindow*> surface_to_window;
@@ -102,17 +124,23 @@ public:
     wl_data_device_manager* GetDataDeviceManager() const { return data_device_manager; }
     wl_data_device* GetDataDevice() const { return data_device; }
     WaylandSeat* GetWaylandSeat() const { return wayland_seat; }
+    wp_viewporter* GetViewporter() const { return viewporter; }
+    wp_fractional_scale_manager_v1* GetFractionalScaleManager() const { return fractional_scale_manager; }
 
     // Format support
     bool HasShmFormat(uint32_t format) const;
 
-    // Scale factor (for HiDPI)
-    int32_t GetOutputScale() const { return scale_factor; }
+    // Outputs (for HiDPI and screen information)
+    const std::vector<WaylandOutput>& GetOutputs() const { return outputs; }
+    const WaylandOutput* FindOutput(wl_output* output) const;
+    // Scale of the primary output, used until a surface has entered an output
+    int32_t GetOutputScale() const;
 
     // Callbacks
     void SetOutputAddedCallback(OutputAddedCallback cb) { output_added_callback = std::move(cb); }
     void SetOutputRemovedCallback(OutputRemovedCallback cb) { output_removed_callback = std::move(cb); }
     void SetSeatAddedCallback(SeatAddedCallback cb) { seat_added_callback = std::move(cb); }
+    void SetOutputsChangedCallback(OutputsChangedCallback cb) { outputs_changed_callback = std::move(cb); }
 
     // Window registration (for input event routing)
     void RegisterWindow(IWaylandWindow* window);
@@ -0,0 +1,80 @@
+#include "WGacImageService.h"
+#include <stdio.h>
+
+using namespace vl;
+using namespace vl::presentation;
+using namespace vl::presentation::wayland;
+
+// GacUI expects the entry point of a GUI application, this check never starts one
+void GuiMain()
+{
+}
+
+// A PNG whose header is valid but whose body is cut in half
+static Ptr<WGacEncodedImage> CreateTruncatedPng()
+{
+    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 64, 64);
+    cairo_surface_flush(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    vint length = cairo_image_surface_get_stride(surface) * 64;
+    vuint32_t seed = 1;
+    for (vint i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (unsigned char)(seed >> 16);
+    }
+    cairo_surface_mark_dirty(surface);
+
+    stream::MemoryStream stream;
+    EncodePng(surface, stream, WGacPngCompression::Store);
+    cairo_surface_destroy(surface);
+    return WGacEncodedImage::CopyMemory(stream.GetInternalBuffer(), (vint)stream.Size() / 2);
+}
+
+// Every attempt to bring the pixels back looks in the decoded image cache first, so misses count decodes
+static vint CountDecodes(Ptr<WGacDecodedImageCache> cache, WGacImage* image)
+{
+    vint misses = cache->GetStatistics().misses;
+    auto frame = dynamic_cast<WGacImageFrame*>(image->GetFrame(0));
+    for (vint i = 0; i < 3; i++) {
+        if (frame->GetSurface()) {
+            return -1;
+        }
+    }
+    return cache->GetStatistics().misses - misses;
+}
+
+static bool Check(const char* name, vint decodes, vint expected)
+{
+    bool passed = decodes == expected;
+    printf("%s %s: %d decodes, expected %d\n", passed ? "PASS" : "FAIL", name, (int)decodes, (int)expected);
+    return passed;
+}
+
+int main()
+{
+    auto encoded = CreateTruncatedPng();
+    auto cache = Ptr(new WGacDecodedImageCache);
+    auto budget = Ptr(new WGacImageMemoryBudget);
+    bool passed = true;
+
+    // The background decode of CreateImageFromFileAsync failed, drawing the image does not try again
+    {
+        auto image = Ptr(new WGacImage(nullptr, Size(64, 64)));
+        image->SetCacheEntry(cache, 1);
+        image->SetRedecodeSource(encoded, budget);
+        image->SetDecodedSurface(nullptr);
+        image->NotifyDecoded();
+        passed &= Check("failed decode", CountDecodes(cache, image.Obj()), 0);
+    }
+
+    // The pixels were dropped under memory pressure and the bytes no longer decode, they are decoded once
+    {
+        auto image = Ptr(new WGacImage(nullptr, cairo_image_surface_create(CAIRO_FORMAT_RGB24, 64, 64)));
+        image->SetCacheEntry(cache, 2);
+        image->SetRedecodeSource(encoded, budget);
+        budget->Trim(0);
+        passed &= Check("failed re-decode", CountDecodes(cache, image.Obj()), 1);
+    }
+
+    return passed ? 0 : 1;
+}
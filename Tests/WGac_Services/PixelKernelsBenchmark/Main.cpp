@@ -0,0 +1,122 @@
+#include "WGacPixelKernels.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace vl::presentation::wayland;
+
+// Times every implementation of the pixel kernels the CPU supports, and checks that each result
+// is within one of the scalar result in every byte. Returns non-zero if a result is further off.
+
+static const size_t PixelCount = 1024 * 1024;
+static const int Repeats = 20;
+
+static const char* const kernelNames[] = { "avx2", "sse2", "scalar" };
+
+// Inputs for every kernel: straight RGBA / RGB bytes and premultiplied ARGB32
+struct Inputs
+{
+    std::vector<uint8_t> rgba;
+    std::vector<uint8_t> rgb;
+    std::vector<uint32_t> argb;
+
+    Inputs()
+        : rgba(PixelCount * 4)
+        , rgb(PixelCount * 3)
+        , argb(PixelCount)
+    {
+        uint32_t seed = 1;
+        auto next = [&]()
+        {
+            seed = seed * 1103515245 + 12345;
+            return (uint8_t)(seed >> 16);
+        };
+        for (size_t i = 0; i < rgba.size(); i++) rgba[i] = next();
+        for (size_t i = 0; i < rgb.size(); i++) rgb[i] = next();
+        for (size_t i = 0; i < PixelCount; i++) {
+            // Mostly opaque or transparent pixels like real images, with every alpha in between
+            uint32_t a = next();
+            if (a < 64) a = 0;
+            else if (a >= 160) a = 255;
+            uint32_t r = next() * a / 255;
+            uint32_t g = next() * a / 255;
+            uint32_t b = next() * a / 255;
+            argb[i] = (a << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+};
+
+struct Kernel
+{
+    const char* name;
+    size_t sourceBytes;
+    size_t targetBytes;
+    void (*run)(const PixelKernels* kernels, const Inputs& inputs, uint8_t* target);
+};
+
+static const Kernel kernels[] = {
+    { "PremultiplyRgba", 4, 4, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->premultiplyRgba(in.rgba.data(), (uint32_t*)out, PixelCount); } },
+    { "PremultiplyBgra", 4, 4, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->premultiplyBgra(in.rgba.data(), (uint32_t*)out, PixelCount); } },
+    { "ExpandRgb", 3, 4, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->expandRgb(in.rgb.data(), (uint32_t*)out, PixelCount); } },
+    { "UnpremultiplyToRgba", 4, 4, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->unpremultiplyToRgba(in.argb.data(), out, PixelCount); } },
+    { "UnpremultiplyToBgra", 4, 4, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->unpremultiplyToBgra(in.argb.data(), out, PixelCount); } },
+    { "UnpremultiplyToRgb", 4, 3, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->unpremultiplyToRgb(in.argb.data(), out, PixelCount); } },
+    { "DisablePixels", 4, 4, [](const PixelKernels* k, const Inputs& in, uint8_t* out) { k->disable(in.argb.data(), (uint32_t*)out, PixelCount); } },
+};
+
+// Fastest of several runs, in GB/s of bytes read and written
+static double Measure(const Kernel& kernel, const PixelKernels* implementation, const Inputs& inputs, uint8_t* target)
+{
+    double best = 0;
+    for (int i = 0; i < Repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        kernel.run(implementation, inputs, target);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        if (best == 0 || seconds.count() < best) best = seconds.count();
+    }
+    double bytes = (double)PixelCount * (kernel.sourceBytes + kernel.targetBytes);
+    return bytes / best / 1e9;
+}
+
+// Number of bytes that differ from the reference by more than one
+static size_t CountMismatches(const std::vector<uint8_t>& result, const std::vector<uint8_t>& reference)
+{
+    size_t mismatches = 0;
+    for (size_t i = 0; i < result.size(); i++) {
+        if (abs((int)result[i] - (int)reference[i]) > 1) mismatches++;
+    }
+    return mismatches;
+}
+
+int main()
+{
+    Inputs inputs;
+    const PixelKernels* scalar = FindPixelKernels("scalar");
+    bool passed = true;
+
+    printf("Dispatched implementation: %s\n", GetPixelKernelsName());
+    for (const Kernel& kernel : kernels) {
+        std::vector<uint8_t> reference(PixelCount * kernel.targetBytes);
+        kernel.run(scalar, inputs, reference.data());
+
+        for (const char* name : kernelNames) {
+            const PixelKernels* implementation = FindPixelKernels(name);
+            if (!implementation) {
+                printf("%-20s %-7s unsupported\n", kernel.name, name);
+                continue;
+            }
+
+            std::vector<uint8_t> result(reference.size());
+            double speed = Measure(kernel, implementation, inputs, result.data());
+            size_t mismatches = CountMismatches(result, reference);
+            printf("%-20s %-7s %8.2f GB/s", kernel.name, name, speed);
+            if (mismatches > 0) {
+                printf("  FAIL: %zu bytes differ from scalar by more than 1", mismatches);
+                passed = false;
+            }
+            printf("\n");
+        }
+    }
+    return passed ? 0 : 1;
+}
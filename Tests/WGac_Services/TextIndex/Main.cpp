@@ -0,0 +1,234 @@
+#include "WGacTextIndex.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace vl;
+using namespace vl::presentation::wayland;
+
+// Checks the UTF-8 conversions and the position mappings of WGacTextIndex against a plain
+// character by character implementation. The dispatched kernels copy ASCII in blocks of 16 or 32
+// characters, so the special characters are placed at every position of texts around those lengths.
+
+/***********************************************************************
+Reference
+***********************************************************************/
+
+static bool IsHighSurrogate(vuint32_t c) { return c >= 0xD800 && c <= 0xDBFF; }
+static bool IsLowSurrogate(vuint32_t c) { return c >= 0xDC00 && c <= 0xDFFF; }
+
+// A code point of the text, with where it starts in both encodings
+struct CodePoint
+{
+    vuint32_t value;
+    vint start;
+    vint units;
+    vint byte;
+    vint bytes;
+};
+
+static std::vector<CodePoint> Split(const std::wstring& text)
+{
+    std::vector<CodePoint> result;
+    vint byte = 0;
+    for (vint i = 0; i < (vint)text.size();) {
+        CodePoint cp;
+        cp.value = (vuint32_t)text[i];
+        cp.start = i;
+        cp.units = 1;
+        if (IsHighSurrogate(cp.value) && i + 1 < (vint)text.size() && IsLowSurrogate((vuint32_t)text[i + 1])) {
+            cp.value = 0x10000 + ((cp.value - 0xD800) << 10) + ((vuint32_t)text[i + 1] - 0xDC00);
+            cp.units = 2;
+        } else if (cp.value > 0x10FFFF) {
+            cp.value = 0xFFFD;
+        }
+        cp.byte = byte;
+        cp.bytes = cp.value < 0x80 ? 1 : cp.value < 0x800 ? 2 : cp.value < 0x10000 ? 3 : 4;
+        byte += cp.bytes;
+        i += cp.units;
+        result.push_back(cp);
+    }
+    return result;
+}
+
+// Lone surrogates are written as three bytes of their own
+static std::string Encode(const std::wstring& text)
+{
+    std::string result;
+    for (auto& cp : Split(text)) {
+        vuint32_t c = cp.value;
+        if (cp.bytes == 1) {
+            result += (char)c;
+        } else if (cp.bytes == 2) {
+            result += (char)(0xC0 | (c >> 6));
+            result += (char)(0x80 | (c & 0x3F));
+        } else if (cp.bytes == 3) {
+            result += (char)(0xE0 | (c >> 12));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        } else {
+            result += (char)(0xF0 | (c >> 18));
+            result += (char)(0x80 | ((c >> 12) & 0x3F));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return result;
+}
+
+// What decoding the encoded text gives: pairs become one character where wchar_t holds any code point,
+// and the three bytes of a lone surrogate, which are not valid UTF-8, become one U+FFFD each
+static std::wstring RoundTrip(const std::wstring& text)
+{
+    std::wstring result;
+    for (auto& cp : Split(text)) {
+        if (cp.value >= 0xD800 && cp.value <= 0xDFFF) {
+            result += std::wstring(3, (wchar_t)0xFFFD);
+        } else if (cp.value >= 0x10000 && sizeof(wchar_t) == 2) {
+            result += (wchar_t)(0xD800 + ((cp.value - 0x10000) >> 10));
+            result += (wchar_t)(0xDC00 + ((cp.value - 0x10000) & 0x3FF));
+        } else {
+            result += (wchar_t)cp.value;
+        }
+    }
+    return result;
+}
+
+// A position inside a surrogate pair maps to the start of the pair
+static vint CharToByte(const std::vector<CodePoint>& cps, vint charPos)
+{
+    for (auto& cp : cps) {
+        if (cp.start + cp.units > charPos) return cp.byte;
+    }
+    return cps.empty() ? 0 : cps.back().byte + cps.back().bytes;
+}
+
+// A byte inside a character maps to that character
+static vint ByteToChar(const std::vector<CodePoint>& cps, vint length, vint bytePos)
+{
+    for (auto& cp : cps) {
+        if (cp.byte + cp.bytes > bytePos) return cp.start;
+    }
+    return length;
+}
+
+/***********************************************************************
+Checks
+***********************************************************************/
+
+static vint failures = 0;
+
+// Prints the first failures only, position is where the special character was inserted, -1 for generated text
+static void Fail(const char* name, vint length, vint position, const char* what)
+{
+    if (failures++ < 20) {
+        if (position >= 0) {
+            printf("FAIL %s at %d of %d characters: %s\n", name, (int)position, (int)length, what);
+        } else {
+            printf("FAIL %s in %d characters: %s\n", name, (int)length, what);
+        }
+    }
+}
+
+static void CheckText(const char* name, const std::wstring& text, vint position)
+{
+    vint length = (vint)text.size();
+    std::string utf8 = Encode(text);
+    std::wstring decoded = RoundTrip(text);
+
+    AString encoded = EncodeUtf8(WString::CopyFrom(text.c_str(), length));
+    if (GetUtf8Length(text.c_str(), length) != (vint)utf8.size()) {
+        Fail(name, length, position, "GetUtf8Length");
+    }
+    if (std::string(encoded.Buffer(), encoded.Length()) != utf8) {
+        Fail(name, length, position, "EncodeUtf8");
+    }
+    WString back = DecodeUtf8(encoded.Buffer(), encoded.Length());
+    if (std::wstring(back.Buffer(), back.Length()) != decoded) {
+        Fail(name, length, position, "DecodeUtf8");
+    }
+
+    WGacTextIndex index;
+    index.SetText(WString::CopyFrom(text.c_str(), length));
+    auto cps = Split(text);
+    for (vint i = -1; i <= length + 1; i++) {
+        if (index.CharToByte(i) != CharToByte(cps, i)) {
+            Fail(name, length, position, "CharToByte");
+            break;
+        }
+    }
+    for (vint i = -1; i <= (vint)utf8.size() + 1; i++) {
+        if (index.ByteToChar(i) != ByteToChar(cps, length, i)) {
+            Fail(name, length, position, "ByteToChar");
+            break;
+        }
+    }
+}
+
+struct Special
+{
+    const char* name;
+    std::wstring text;
+};
+
+int main()
+{
+    const Special specials[] = {
+        { "ASCII", L"" },
+        { "two byte", std::wstring(1, (wchar_t)0xE9) },
+        { "three byte", std::wstring(1, (wchar_t)0x4E2D) },
+        { "surrogate pair", std::wstring({ (wchar_t)0xD83D, (wchar_t)0xDE00 }) },
+        { "lone high surrogate", std::wstring(1, (wchar_t)0xD83D) },
+        { "lone low surrogate", std::wstring(1, (wchar_t)0xDE00) },
+        { "reversed surrogates", std::wstring({ (wchar_t)0xDE00, (wchar_t)0xD83D }) },
+    };
+    const vint lengths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 200 };
+
+    printf("Dispatched implementation: %s\n", GetTextKernelsName());
+    for (auto& special : specials) {
+        for (vint length : lengths) {
+            // ASCII text with the special character inserted at every position
+            for (vint position = 0; position <= length; position++) {
+                std::wstring text;
+                for (vint i = 0; i < length; i++) {
+                    text += (wchar_t)(L'a' + i % 26);
+                }
+                text.insert((size_t)position, special.text);
+                CheckText(special.name, text, position);
+                if (special.text.empty()) break;
+            }
+
+            // The special character repeated, then followed by ASCII that the kernels copy in blocks
+            std::wstring text;
+            for (vint i = 0; i < length; i++) {
+                text += special.text.empty() ? (wchar_t)(L'A' + i % 26) : special.text[i % special.text.size()];
+            }
+            for (vint i = 0; i < length; i++) {
+                text += (wchar_t)(L'0' + i % 10);
+            }
+            CheckText(special.name, text, -1);
+        }
+    }
+
+    // Everything mixed, with checkpoints landing on every kind of character
+    {
+        vuint32_t seed = 1;
+        for (vint round = 0; round < 64; round++) {
+            std::wstring text;
+            vint length = 16 + round * 4;
+            while ((vint)text.size() < length) {
+                seed = seed * 1103515245 + 12345;
+                auto& special = specials[(seed >> 16) % (sizeof(specials) / sizeof(*specials))];
+                if (special.text.empty()) {
+                    text += (wchar_t)(L' ' + (seed >> 8) % 95);
+                } else {
+                    text += special.text;
+                }
+            }
+            CheckText("mixed", text, -1);
+        }
+    }
+
+    printf("%s: %d failures\n", failures == 0 ? "PASS" : "FAIL", (int)failures);
+    return failures == 0 ? 0 : 1;
+}